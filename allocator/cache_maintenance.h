@@ -0,0 +1,213 @@
+#ifndef _CACHE_MAINTENANCE_H_
+#define _CACHE_MAINTENANCE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <misc/cpp_attributes.h>
+#include <misc/error_handling.h>
+#include <system/fork_hooks.h>
+
+#include <concurrency/rseq/rseq_base.h>
+
+// slabs at the front of each cpu's chunk cache_maintenance keeps faulted
+// in by default (see object_allocator::prefault_cpu). 0 -> none.
+#ifndef SLAB_PREFAULT_SLABS
+#define SLAB_PREFAULT_SLABS 4
+#endif
+
+namespace alloc {
+
+// Background thread that drains the caches of cpus (or mm_cids) that have
+// been idle for a while so memory a short lived job left on a cpu is
+// usable elsewhere. A cpu is idle once allocator_t::cpu_activity has not
+// changed for idle_us. Draining a cpu that just looked idle is still safe
+// (see object_allocator::drain_cpu), it only has to refill. Each period
+// it also prefaults the next prefault_slabs slabs of every cpu whose chunk
+// moved (see object_allocator::prefault_cpu) so carving a new slab doesn't
+// take page faults in the allocation path.
+//
+// Needs rseq_fence_supported(), start() does nothing otherwise. The thread
+// does not exist in a forked child, there it is stopped and can be
+// start()ed again.
+template<typename allocator_t>
+struct cache_maintenance {
+    allocator_t * const allocator;
+    const uint64_t      period_us;
+    // idle_us in periods
+    const uint32_t idle_periods;
+    const uint64_t prefault_slabs;
+    // periods_idle of a cpu drained since its activity last changed
+    static constexpr uint32_t drained = (~(0U));
+
+    pthread_t       tid;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint32_t        running;
+
+    uint32_t   nidx;
+    uint64_t * last_activity;
+    uint32_t * periods_idle;
+    uint64_t * last_chunks;
+
+    // total objects and slabs moved
+    uint64_t ndrained;
+    // total bytes prefault_cpu covered
+    uint64_t nprefaulted;
+
+    fork_hooks fork_node;
+
+    cache_maintenance(allocator_t * _allocator,
+                      uint64_t      _period_us,
+                      uint64_t      idle_us,
+                      uint64_t      _prefault_slabs = SLAB_PREFAULT_SLABS)
+        : allocator(_allocator),
+          period_us(_period_us),
+          idle_periods((idle_us + _period_us - 1) / _period_us),
+          prefault_slabs(_prefault_slabs),
+          running(0),
+          nidx(0),
+          last_activity(NULL),
+          periods_idle(NULL),
+          last_chunks(NULL),
+          ndrained(0),
+          nprefaulted(0) {
+        DIE_ASSERT(period_us, "Error maintenance period must be non-zero\n");
+        ERROR_ASSERT(!pthread_mutex_init(&lock, NULL));
+        ERROR_ASSERT(!pthread_cond_init(&cond, NULL));
+
+        fork_node = {
+            _fork_prepare, _fork_parent, _fork_child, this, NULL, NULL
+        };
+        add_fork_hooks(&fork_node);
+    }
+
+    ~cache_maintenance() {
+        remove_fork_hooks(&fork_node);
+        stop();
+        free(last_activity);
+        free(periods_idle);
+        free(last_chunks);
+        pthread_mutex_destroy(&lock);
+        pthread_cond_destroy(&cond);
+    }
+
+    // the maintenance thread never holds lock while waiting or draining
+    static void
+    _fork_prepare(void * _this) {
+        pthread_mutex_lock(&(((cache_maintenance *)_this)->lock));
+    }
+
+    static void
+    _fork_parent(void * _this) {
+        pthread_mutex_unlock(&(((cache_maintenance *)_this)->lock));
+    }
+
+    static void
+    _fork_child(void * _this) {
+        cache_maintenance * cm = (cache_maintenance *)_this;
+        cm->running            = 0;
+        // the thread may have been waiting on it
+        ERROR_ASSERT(!pthread_cond_init(&(cm->cond), NULL));
+        pthread_mutex_unlock(&(cm->lock));
+    }
+
+    // Drains every cpu whose activity has been unchanged for idle_periods
+    // calls and prefaults the chunks that moved. Can be driven directly
+    // instead of through start().
+    uint32_t
+    tick() {
+        if (BRANCH_UNLIKELY(last_activity == NULL)) {
+            nidx          = allocator->m->nprocs;
+            last_activity = (uint64_t *)calloc(nidx, sizeof(uint64_t));
+            periods_idle  = (uint32_t *)calloc(nidx, sizeof(uint32_t));
+            last_chunks   = (uint64_t *)calloc(nidx, sizeof(uint64_t));
+            ERROR_ASSERT(last_activity != NULL && periods_idle != NULL &&
+                         last_chunks != NULL);
+        }
+
+        uint32_t ncpus = 0;
+        for (uint32_t i = 0; i < nidx; ++i) {
+            if (prefault_slabs) {
+                const uint64_t chunks = allocator->chunk_activity(i);
+                if (chunks != last_chunks[i]) {
+                    last_chunks[i] = chunks;
+                    nprefaulted += allocator->prefault_cpu(i, prefault_slabs);
+                }
+            }
+
+            const uint64_t activity = allocator->cpu_activity(i);
+            if (activity != last_activity[i]) {
+                last_activity[i] = activity;
+                periods_idle[i]  = 0;
+                continue;
+            }
+            // nothing cached
+            if (activity == 0 || periods_idle[i] == drained ||
+                periods_idle[i]++ < idle_periods) {
+                continue;
+            }
+
+            ndrained += allocator->drain_cpu(i);
+            last_activity[i] = allocator->cpu_activity(i);
+            periods_idle[i]  = drained;
+            ++ncpus;
+        }
+        return ncpus;
+    }
+
+    static void *
+    maintenance_loop(void * _this) {
+        cache_maintenance * cm = (cache_maintenance *)_this;
+        // drains other cpus of a multi process heap from there
+        rseq_may_migrate = 1;
+
+        pthread_mutex_lock(&(cm->lock));
+        while (cm->running) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            const uint64_t ns = ts.tv_nsec + cm->period_us * 1000;
+            ts.tv_sec += ns / (1000 * 1000 * 1000);
+            ts.tv_nsec = ns % (1000 * 1000 * 1000);
+            pthread_cond_timedwait(&(cm->cond), &(cm->lock), &ts);
+
+            if (cm->running) {
+                pthread_mutex_unlock(&(cm->lock));
+                cm->tick();
+                pthread_mutex_lock(&(cm->lock));
+            }
+        }
+        pthread_mutex_unlock(&(cm->lock));
+        return NULL;
+    }
+
+    // returns 0 if remote draining is not supported (nothing started)
+    uint32_t
+    start() {
+        if (running || !rseq_fence_supported()) {
+            return running;
+        }
+        running = 1;
+        ERROR_ASSERT(!pthread_create(&tid, NULL, maintenance_loop, this));
+        return 1;
+    }
+
+    void
+    stop() {
+        pthread_mutex_lock(&lock);
+        const uint32_t was_running = running;
+        running                    = 0;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+
+        if (was_running) {
+            ERROR_ASSERT(!pthread_join(tid, NULL));
+        }
+    }
+};
+
+}  // namespace alloc
+
+#endif
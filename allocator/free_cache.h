@@ -9,9 +9,165 @@
 
 template<uint32_t cache_size>
 struct free_cache {
-    uint32_t current_idx;
+    // set in current_idx while another thread drains this cache (see
+    // object_allocator::drain_cpu). Any critical section that sees it
+    // leaves the cache and its slab_manager alone: push / pop fail their
+    // bounds check and the slab list operations back off.
+    static constexpr uint64_t STOPPED = (1UL) << 63;
+
+    uint64_t current_idx;
     uint64_t ptrs[cache_size];
 
+
+    // Sets STOPPED on caches(0) ... caches(n - 1)
+    template<typename caches_t>
+    static void
+    set_stopped(const uint32_t n, caches_t caches) {
+        for (uint32_t i = 0; i < n; ++i) {
+            __atomic_fetch_or(&(caches(i)->current_idx),
+                              STOPPED,
+                              __ATOMIC_SEQ_CST);
+        }
+    }
+
+    // Sets STOPPED on the n caches of index idx (caches(i)) and, if
+    // rseq_fence_supported(), waits until no critical section that missed
+    // it can still be running on idx. Push / pop commit with a plain add /
+    // sub so one that read current_idx before STOPPED was set can clear it
+    // again. Any such commit is done once the fence returns so check and
+    // redo.
+    template<typename caches_t>
+    static void
+    stop(const uint32_t idx, const uint32_t n, caches_t caches) {
+        set_stopped(n, caches);
+        if (!rseq_fence_supported()) {
+            return;
+        }
+        uint32_t lost;
+        do {
+            rseq_fence(idx);
+            lost = 0;
+            for (uint32_t i = 0; i < n; ++i) {
+                uint64_t * cur = &(caches(i)->current_idx);
+                if (!(__atomic_load_n(cur, __ATOMIC_SEQ_CST) & STOPPED)) {
+                    __atomic_fetch_or(cur, STOPPED, __ATOMIC_SEQ_CST);
+                    lost = 1;
+                }
+            }
+        } while (lost);
+    }
+
+    // Push / pop on the current cpu's (or mm_cid's) cache in rseq. base is
+    // index 0's cache, index i's is at base + (i << log_cpu_stride) (e.g
+    // the fc of every cpu's slab_manager for one size class).
+
+    // 0 if the cache is empty (or being drained)
+    template<uint64_t log_cpu_stride>
+    static uint64_t
+    try_pop(free_cache * base) {
+
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"  // NOLINT
+        uint64_t ret, fc_cache;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic push
+        // clang-format off
+                asm volatile(
+                    RSEQ_INFO_DEF(32)
+                    RSEQ_CS_ARR_DEF()
+
+
+                    "1:\n\t"
+                    // any register will do
+                    RSEQ_PREP_CS_DEF(%[ret])
+
+
+                    RSEQ_LOAD_CUR_IDX(%k[fc_cache])
+                    "salq %[LOG_CPU_STRIDE], %[fc_cache]\n\t"
+                    "addq %[fc_base], %[fc_cache]\n\t"
+
+                    // empty wraps and STOPPED is set, both are out of
+                    // bounds
+                    "movq (%[fc_cache]), %[ret]\n\t"
+                    "subq $1, %[ret]\n\t"
+                    "cmpq %[CACHE_SIZE], %[ret]\n\t"
+                    "jae 5f\n\t"
+
+                    "movq 8(%[fc_cache], %[ret], 8), %[ret]\n\t"
+
+                    "subq $1, (%[fc_cache])\n\t"
+                    "2:\n\t"
+
+                    RSEQ_START_ABORT_DEF()
+                    "jmp 1b\n\t"
+                    // nothing to pop, kept out of line
+                    "5:\n\t"
+                    "xorl %k[ret], %k[ret]\n\t"
+                    "jmp 2b\n\t"
+                    RSEQ_END_ABORT_DEF()
+
+                    : [ ret ] "=&r" (ret),
+                      [ fc_cache ] "=&r" (fc_cache),
+                      [ m_clobber ] "=&m" (*base)
+                    : [ fc_base ] "r" (base),
+                      [ LOG_CPU_STRIDE ] "i" (log_cpu_stride),
+                      RSEQ_AREA_OPERANDS(),
+                      [ CACHE_SIZE ] "i" (cache_size)
+                    : "cc");
+        // clang-format on
+        return ret;
+    }
+
+    // 1 if the cache is full (or being drained)
+    template<uint64_t log_cpu_stride>
+    static uint64_t
+    try_push(free_cache * base, uint64_t ptr) {
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"  // NOLINT
+        uint64_t idx, fc_cache;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic push
+        // clang-format off
+                asm volatile goto(
+                    RSEQ_INFO_DEF(32)
+                    RSEQ_CS_ARR_DEF()
+
+
+                    "1:\n\t"
+                    // any register will do
+                    RSEQ_PREP_CS_DEF(%[fc_cache])
+
+
+                    RSEQ_LOAD_CUR_IDX(%k[fc_cache])
+                    "salq %[LOG_CPU_STRIDE], %[fc_cache]\n\t"
+                    "addq %[fc_base], %[fc_cache]\n\t"
+
+                    // full or STOPPED
+                    "movq (%[fc_cache]), %[idx]\n\t"
+                    "cmpq %[CACHE_SIZE], %[idx]\n\t"
+                    "jae %l[no_push]\n\t"
+
+                    "movq %[ptr], 8(%[fc_cache], %[idx], 8)\n\t"
+                    "addq $1, (%[fc_cache])\n\t"
+                    "2:\n\t"
+
+                    RSEQ_START_ABORT_DEF()
+                    "jmp 1b\n\t"
+                    RSEQ_END_ABORT_DEF()
+                    : [ idx ] "=&r" (idx),
+                      [ fc_cache ] "=&r" (fc_cache)
+                    : [ ptr ] "r" (ptr),
+                     [ fc_base ] "r" (base),
+                     [ LOG_CPU_STRIDE ] "i" (log_cpu_stride),
+                     RSEQ_AREA_OPERANDS(),
+                     [ CACHE_SIZE ] "i" (cache_size)
+                    : "cc", "memory"
+                    : no_push);
+        // clang-format on
+        return 0;
+    no_push:
+        return 1;
+    }
 };
 
 #endif
@@ -0,0 +1,417 @@
+#ifndef _HUGEPAGE_FILLER_H_
+#define _HUGEPAGE_FILLER_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <misc/cpp_attributes.h>
+#include <misc/error_handling.h>
+#include <optimized/bits.h>
+#include <optimized/const_math.h>
+#include <system/mmap_helpers.h>
+
+namespace alloc {
+
+// Free slabs (empty slabs a drain took back, see object_allocator::_drain_cpu)
+// tracked per huge page of the region so memory goes back to the os without
+// breaking up huge pages:
+//
+// - a huge page is released (MADV_DONTNEED of all of it) once every slab
+//   overlapping it is free, never just part of it
+// - free slabs are handed out from the huge page with the fewest free slabs
+//   (the most used one), ones that are still backed first, so partially
+//   used huge pages fill up and mostly free ones get to be released
+//
+// A slab belongs to the huge page it starts in (it may end in the next).
+// Slabs are put / taken per set, for slab_allocator_t's that can't hand a
+// slab to any size class (all slabs of a huge page must be in one set).
+// Everything is under lock, nfree can be checked without it. If lock is
+// robust (shared between processes) and its owner died, or the filler is
+// taken over from a process that may have died (see recover), the lists
+// and counts are rebuilt from each huge page's free_mask.
+//
+// Under memory pressure release_free() drops the pages of free slabs in
+// huge pages that still have slabs in use as well (breaking them up).
+//
+// Lives in the region it tracks (object_allocator's memory_layout, the
+// per huge page state at the region's end, see state_size) so it's kept
+// along with the slabs when the region is file backed. Memory is given
+// back with drop_advice: MADV_DONTNEED for private memory, MADV_REMOVE for
+// shared (DONTNEED would leave the pages in the file).
+template<typename slab_t, uint32_t nsets>
+struct hugepage_filler {
+    static constexpr uint64_t hp_size = HUGE_PAGE_SIZE;
+    // most slabs that can start in one huge page
+    static constexpr uint32_t max_homed =
+        (hp_size + sizeof(slab_t) - 1) / sizeof(slab_t);
+    static_assert(max_homed < 64);
+
+    static constexpr uint32_t nil = (~(0U));
+
+    struct hp_state {
+        // bit i -> i-th slab starting in this huge page is free
+        uint64_t free_mask;
+        // bytes of this huge page covered by free slabs
+        uint32_t free_bytes;
+        uint32_t released;
+        // in heads[set][released][bitcount(free_mask)] if free_mask
+        uint32_t prev;
+        uint32_t next;
+        // free slabs (bits as in free_mask) release_free() dropped the
+        // pages of, and how many bytes that was. Only if !released.
+        uint64_t dropped_mask;
+        uint64_t dropped_bytes;
+        // set of the slabs in free_mask
+        uint32_t set;
+    };
+
+    pthread_mutex_t  lock;
+    const uint64_t   base;
+    const uint32_t   nhp;
+    const int32_t    drop_advice;
+    hp_state * const hps;
+
+    uint32_t heads[nsets][2][64];
+    // bit k -> heads[set][released][k] is non-empty
+    uint64_t nonempty[nsets][2];
+    uint64_t nfree[nsets];
+    // huge pages currently released
+    uint64_t nreleased;
+    // bytes dropped by release_free() outside of them
+    uint64_t ndropped_bytes;
+
+    // _hps is state_size(region_start, region_end) bytes of zeroed memory
+    hugepage_filler(uint64_t   region_start,
+                    uint64_t   region_end,
+                    hp_state * _hps,
+                    int32_t    _drop_advice)
+        : base(cmath::rounddown<uint64_t>(region_start, hp_size)),
+          nhp((cmath::roundup<uint64_t>(region_end, hp_size) - base) /
+              hp_size),
+          drop_advice(_drop_advice),
+          hps(_hps) {
+        ERROR_ASSERT(!pthread_mutex_init(&lock, NULL));
+        _clear_lists();
+    }
+
+    // bytes of per huge page state for [region_start, region_end), a
+    // multiple of PAGE_SIZE
+    static constexpr uint64_t
+    state_size(const uint64_t region_start, const uint64_t region_end) {
+        return cmath::roundup<uint64_t>(
+            ((cmath::roundup<uint64_t>(region_end, hp_size) -
+              cmath::rounddown<uint64_t>(region_start, hp_size)) /
+             hp_size) *
+                sizeof(hp_state),
+            PAGE_SIZE);
+    }
+
+    uint64_t
+    _hps_size() const {
+        return cmath::roundup<uint64_t>(nhp * sizeof(hp_state), PAGE_SIZE);
+    }
+
+    void
+    _clear_lists() {
+        memset(heads, -1, sizeof(heads));
+        memset(nonempty, 0, sizeof(nonempty));
+        memset(nfree, 0, sizeof(nfree));
+        nreleased      = 0;
+        ndropped_bytes = 0;
+    }
+
+    void
+    _lock() {
+        const int32_t r = pthread_mutex_lock(&lock);
+        if (BRANCH_UNLIKELY(r == EOWNERDEAD)) {
+            recover();
+            ERROR_ASSERT(!pthread_mutex_consistent(&lock));
+            return;
+        }
+        DIE_ASSERT(!r, "Error taking the filler's lock (%d)\n", r);
+    }
+
+    // Rebuilds the lists and counts from each huge page's free_mask, set
+    // and dropped_mask, whatever state a put / take / release_free that
+    // never finished left them in. A slab it was taking or putting stays
+    // out (leaked). With lock held, or no one else using the filler.
+    void
+    recover() {
+        _clear_lists();
+        for (uint32_t hp = 0; hp < nhp; ++hp) {
+            hps[hp].free_bytes = 0;
+        }
+        // bytes first, a slab can cover part of the next huge page too
+        for (uint32_t hp = 0; hp < nhp; ++hp) {
+            for (uint64_t todo = hps[hp].free_mask; todo; todo &= (todo - 1)) {
+                const slab_t * slab =
+                    (slab_t *)((_first_slab(hp) +
+                                bits::find_first_one<uint64_t>(todo)) *
+                               sizeof(slab_t));
+                _for_each_hp(slab, [&](uint32_t _hp, uint64_t bytes) {
+                    hps[_hp].free_bytes += bytes;
+                });
+            }
+        }
+        for (uint32_t hp = 0; hp < nhp; ++hp) {
+            hp_state * const h = hps + hp;
+            h->dropped_mask &= h->free_mask;
+            h->dropped_bytes = 0;
+            if (h->free_bytes == hp_size) {
+                if (!h->released) {
+                    madv_release((void *)(base + hp * hp_size),
+                                 hp_size,
+                                 drop_advice);
+                }
+                h->released     = 1;
+                h->dropped_mask = 0;
+                ++nreleased;
+            }
+            else {
+                h->released = 0;
+            }
+            for (uint64_t todo = h->dropped_mask; todo; todo &= (todo - 1)) {
+                uint64_t lo;
+                h->dropped_bytes += _inner_pages(
+                    (slab_t *)((_first_slab(hp) +
+                                bits::find_first_one<uint64_t>(todo)) *
+                               sizeof(slab_t)),
+                    hp,
+                    &lo);
+            }
+            ndropped_bytes += h->dropped_bytes;
+            if (h->free_mask) {
+                nfree[h->set] += bits::bitcount<uint64_t>(h->free_mask);
+                _link(hp, h->set);
+            }
+        }
+    }
+
+    // forget every free slab (for object_allocator::reset)
+    void
+    clear() {
+        _lock();
+        madv_release(hps, _hps_size(), drop_advice);
+        _clear_lists();
+        pthread_mutex_unlock(&lock);
+    }
+
+    // index (in all of memory) of the first slab starting in huge page hp
+    uint64_t ALWAYS_INLINE PURE_ATTR
+    _first_slab(const uint32_t hp) const {
+        return (base + hp * hp_size + sizeof(slab_t) - 1) / sizeof(slab_t);
+    }
+
+    void
+    _unlink(const uint32_t hp, const uint32_t set) {
+        hp_state * const h = hps + hp;
+        if (h->free_mask == 0) {
+            return;
+        }
+        const uint32_t k = bits::bitcount<uint64_t>(h->free_mask);
+        if (h->prev != nil) {
+            hps[h->prev].next = h->next;
+        }
+        else {
+            heads[set][h->released][k] = h->next;
+            if (h->next == nil) {
+                nonempty[set][h->released] &= (~((1UL) << k));
+            }
+        }
+        if (h->next != nil) {
+            hps[h->next].prev = h->prev;
+        }
+    }
+
+    void
+    _link(const uint32_t hp, const uint32_t set) {
+        hp_state * const h = hps + hp;
+        if (h->free_mask == 0) {
+            return;
+        }
+        const uint32_t k = bits::bitcount<uint64_t>(h->free_mask);
+        h->prev          = nil;
+        h->next          = heads[set][h->released][k];
+        if (h->next != nil) {
+            hps[h->next].prev = hp;
+        }
+        heads[set][h->released][k] = hp;
+        nonempty[set][h->released] |= ((1UL) << k);
+    }
+
+    void
+    _add_bytes(const uint32_t hp, const uint64_t bytes, const uint32_t set) {
+        hp_state * const h = hps + hp;
+        h->free_bytes += bytes;
+        if (h->free_bytes == hp_size && !h->released) {
+            madv_release((void *)(base + hp * hp_size), hp_size, drop_advice);
+            _unlink(hp, set);
+            h->released = 1;
+            _link(hp, set);
+            ++nreleased;
+            // now counted in nreleased
+            ndropped_bytes -= h->dropped_bytes;
+            h->dropped_mask  = 0;
+            h->dropped_bytes = 0;
+        }
+    }
+
+    void
+    _sub_bytes(const uint32_t hp, const uint64_t bytes, const uint32_t set) {
+        hp_state * const h = hps + hp;
+        h->free_bytes -= bytes;
+        // memory will be faulted back in by whoever uses the slab
+        if (h->released) {
+            _unlink(hp, set);
+            h->released = 0;
+            _link(hp, set);
+            --nreleased;
+        }
+    }
+
+    // [*lo, *lo + return) are the pages of slab entirely in huge page hp
+    // (its home, so no page is dropped for two slabs or two huge pages)
+    uint64_t
+    _inner_pages(const slab_t * slab, const uint32_t hp, uint64_t * lo) const {
+        const uint64_t start = (uint64_t)slab;
+        const uint64_t hi    = cmath::rounddown<uint64_t>(
+            cmath::min<uint64_t>(start + sizeof(slab_t),
+                                 base + (hp + 1) * hp_size),
+            PAGE_SIZE);
+        *lo = cmath::roundup<uint64_t>(start, PAGE_SIZE);
+        return hi > *lo ? hi - *lo : 0;
+    }
+
+    // applies f(hp, bytes) to the (one or two) huge pages slab overlaps
+    template<typename F>
+    void
+    _for_each_hp(const slab_t * slab, F f) {
+        const uint64_t start  = (uint64_t)slab;
+        const uint32_t hp     = (start - base) / hp_size;
+        const uint64_t hp_end = base + (hp + 1) * hp_size;
+        if (start + sizeof(slab_t) <= hp_end) {
+            f(hp, sizeof(slab_t));
+        }
+        else {
+            f(hp, hp_end - start);
+            f(hp + 1, start + sizeof(slab_t) - hp_end);
+        }
+    }
+
+    // slab must be empty and unreachable by anything but stale readers
+    void
+    put(slab_t * slab, const uint32_t set) {
+        const uint32_t hp = (((uint64_t)slab) - base) / hp_size;
+        const uint64_t bit =
+            (1UL) << (((uint64_t)slab) / sizeof(slab_t) - _first_slab(hp));
+
+        _lock();
+        _unlink(hp, set);
+        hps[hp].free_mask |= bit;
+        hps[hp].set = set;
+        _link(hp, set);
+        __atomic_store_n(nfree + set, nfree[set] + 1, __ATOMIC_RELAXED);
+
+        _for_each_hp(slab, [&](uint32_t _hp, uint64_t bytes) {
+            _add_bytes(_hp, bytes, set);
+        });
+        pthread_mutex_unlock(&lock);
+    }
+
+    // a free slab of set from the most used huge page that has one, NULL
+    // if there are none. Its memory is as it was when put (or zero if
+    // released).
+    slab_t *
+    take(const uint32_t set) {
+        if (__atomic_load_n(nfree + set, __ATOMIC_RELAXED) == 0) {
+            return NULL;
+        }
+
+        _lock();
+        uint32_t hp = nil;
+        for (uint32_t released = 0; released < 2; ++released) {
+            if (nonempty[set][released]) {
+                hp = heads[set][released][bits::find_first_one<uint64_t>(
+                    nonempty[set][released])];
+                break;
+            }
+        }
+        if (hp == nil) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+
+        _unlink(hp, set);
+        const uint32_t bit = bits::find_first_one<uint64_t>(hps[hp].free_mask);
+        hps[hp].free_mask &= (hps[hp].free_mask - 1);
+        _link(hp, set);
+        __atomic_store_n(nfree + set, nfree[set] - 1, __ATOMIC_RELAXED);
+
+        slab_t * const slab =
+            (slab_t *)((_first_slab(hp) + bit) * sizeof(slab_t));
+        if (hps[hp].dropped_mask & ((1UL) << bit)) {
+            uint64_t       lo;
+            const uint64_t dropped = _inner_pages(slab, hp, &lo);
+            hps[hp].dropped_mask &= (~((1UL) << bit));
+            hps[hp].dropped_bytes -= dropped;
+            __atomic_store_n(&ndropped_bytes,
+                             ndropped_bytes - dropped,
+                             __ATOMIC_RELAXED);
+        }
+        _for_each_hp(slab, [&](uint32_t _hp, uint64_t bytes) {
+            _sub_bytes(_hp, bytes, set);
+        });
+        pthread_mutex_unlock(&lock);
+        return slab;
+    }
+
+    // Drops the pages of every free slab not in a released huge page, i.e
+    // breaks up huge pages that still have slabs in use. For memory
+    // pressure, otherwise memory only goes back a whole huge page at a
+    // time. Free slabs stay where they are (and fault back in zeroed).
+    // Returns bytes dropped.
+    uint64_t
+    release_free() {
+        uint64_t ndropped = 0;
+        _lock();
+        for (uint32_t set = 0; set < nsets; ++set) {
+            for (uint64_t ks = nonempty[set][0]; ks; ks &= (ks - 1)) {
+                for (uint32_t hp =
+                         heads[set][0][bits::find_first_one<uint64_t>(ks)];
+                     hp != nil;
+                     hp = hps[hp].next) {
+                    hp_state * const h = hps + hp;
+                    for (uint64_t todo = h->free_mask & (~(h->dropped_mask));
+                         todo;
+                         todo &= (todo - 1)) {
+                        const uint32_t bit =
+                            bits::find_first_one<uint64_t>(todo);
+                        uint64_t       lo;
+                        const uint64_t bytes = _inner_pages(
+                            (slab_t *)((_first_slab(hp) + bit) *
+                                       sizeof(slab_t)),
+                            hp,
+                            &lo);
+                        if (bytes) {
+                            madv_release((void *)lo, bytes, drop_advice);
+                        }
+                        h->dropped_mask |= ((1UL) << bit);
+                        h->dropped_bytes += bytes;
+                        ndropped += bytes;
+                    }
+                }
+            }
+        }
+        __atomic_store_n(&ndropped_bytes,
+                         ndropped_bytes + ndropped,
+                         __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lock);
+        return ndropped;
+    }
+};
+
+}  // namespace alloc
+
+#endif
@@ -0,0 +1,326 @@
+#ifndef _IO_BUFFER_POOL_H_
+#define _IO_BUFFER_POOL_H_
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <misc/cpp_attributes.h>
+#include <misc/error_handling.h>
+#include <optimized/const_math.h>
+#include <system/fork_hooks.h>
+#include <system/mmap_helpers.h>
+
+#include <concurrency/rseq/rseq_base.h>
+
+#include <allocator/free_cache.h>
+
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+namespace alloc {
+
+// Fixed size I/O buffers in one contiguous run of slabs taken from an
+// object_allocator's region (see object_allocator::take_raw_slabs), meant
+// to be registered with io_uring (register_buffers) so READ_FIXED /
+// WRITE_FIXED don't pin and unpin the pages on every I/O. The run is
+// registered as one io_uring buffer per reg_size bytes so the buf_index of
+// a buffer is just its offset >> log2(reg_size).
+//
+// Free buffers are cached per cpu (or mm_cid) in free_caches pushed /
+// popped in rseq, the same as the allocator's objects. Behind those is a
+// stack under lock that refills and takes overflow half a cache at a time.
+// Any thread can put a buffer, not just the one that got it. Once the
+// stack is empty get() drains the other cpus' caches (needs
+// rseq_fence_supported(), otherwise buffers cached elsewhere stay there).
+//
+// A ring pins the pages for as long as it has them registered: unregister
+// (or close the ring) before destroying the pool, the slabs then go back
+// to the allocator. The allocator's reset() takes them regardless (the
+// pool must not be used after, destroying it is fine).
+template<typename allocator_t,
+         uint64_t buf_size,
+         uint32_t cache_size_lower_bound = 15>
+struct io_buffer_pool {
+    using slab_t = typename allocator_t::slab_t;
+
+    // most buffers a ring can register, each at most 1gb
+    static constexpr uint64_t max_reg_bufs = (1UL) << 14;
+    static constexpr uint64_t reg_size     = HUGE_PAGE_SIZE;
+    static constexpr uint64_t log_reg_size = cmath::ulog2<uint64_t>(reg_size);
+
+    // buffers never straddle two registered ones and can be used for
+    // O_DIRECT
+    static_assert(buf_size >= 512 && buf_size <= reg_size &&
+                  (buf_size & (buf_size - 1)) == 0);
+
+    // pad each cpu's cache to a power of 2 so the cpu offset in rseq is
+    // just a shift (and no two cpus share a line)
+    static constexpr uint32_t cache_size =
+        (cmath::next_p2<uint32_t>(8 + sizeof(uint64_t) *
+                                          cache_size_lower_bound) -
+         8) /
+        sizeof(uint64_t);
+    using cache_t = free_cache<cache_size>;
+    static constexpr uint64_t _log_cpu_stride =
+        cmath::ulog2<uint64_t>(sizeof(cache_t));
+    static_assert((1UL) << _log_cpu_stride == sizeof(cache_t));
+
+    // moved between a cache and the stack at a time
+    static constexpr uint32_t batch = (cache_size + 1) / 2;
+
+    allocator_t * const allocator;
+    slab_t *            slabs;
+    uint64_t            nslabs;
+    // heap generation slabs were taken in (see put_raw_slabs)
+    uint64_t generation;
+    // first buffer, page aligned
+    uint64_t base;
+    uint64_t nbufs;
+
+    uint32_t  nidx;
+    cache_t * caches;
+
+    pthread_mutex_t lock;
+    uint64_t *      stack;
+    uint64_t        nstack;
+
+    fork_hooks fork_node;
+
+    // at least _nbufs buffers (the rest of the last slab is used too)
+    io_buffer_pool(allocator_t * _allocator, uint64_t _nbufs)
+        : allocator(_allocator) {
+        nslabs = (_nbufs * buf_size + PAGE_SIZE + sizeof(slab_t) - 1) /
+                 sizeof(slab_t);
+        slabs = allocator->take_raw_slabs(nslabs, &generation);
+        DIE_ASSERT(slabs != NULL,
+                   "Error no room for %lu io buffers of %lu bytes\n",
+                   _nbufs,
+                   buf_size);
+
+        base  = cmath::roundup<uint64_t>((uint64_t)slabs, PAGE_SIZE);
+        nbufs = ((uint64_t)(slabs + nslabs) - base) / buf_size;
+        DIE_ASSERT(nregistered() <= max_reg_bufs,
+                   "Error %lu io buffers of %lu bytes can't be registered\n",
+                   nbufs,
+                   buf_size);
+
+        nidx   = allocator->m->nprocs;
+        caches = (cache_t *)aligned_alloc(sizeof(cache_t),
+                                          nidx * sizeof(cache_t));
+        stack  = (uint64_t *)malloc(nbufs * sizeof(uint64_t));
+        ERROR_ASSERT(caches != NULL && stack != NULL);
+        memset(caches, 0, nidx * sizeof(cache_t));
+        // threads without an index of their own go straight to the stack
+        // (see rseq_fallback_no_idx)
+        if (rseq_fallback) {
+            caches[rseq_fallback_no_idx].current_idx = cache_t::STOPPED;
+        }
+
+        // lowest addresses on top
+        for (nstack = 0; nstack < nbufs; ++nstack) {
+            stack[nstack] = base + (nbufs - nstack - 1) * buf_size;
+        }
+
+        ERROR_ASSERT(!pthread_mutex_init(&lock, NULL));
+        fork_node = {
+            _fork_prepare, _fork_parent, _fork_child, this, NULL, NULL
+        };
+        add_fork_hooks(&fork_node);
+    }
+
+    ~io_buffer_pool() {
+        remove_fork_hooks(&fork_node);
+        allocator->put_raw_slabs(slabs, nslabs, generation);
+        free(caches);
+        free(stack);
+        pthread_mutex_destroy(&lock);
+    }
+
+    static void
+    _fork_prepare(void * _this) {
+        pthread_mutex_lock(&(((io_buffer_pool *)_this)->lock));
+    }
+
+    static void
+    _fork_parent(void * _this) {
+        pthread_mutex_unlock(&(((io_buffer_pool *)_this)->lock));
+    }
+
+    static void
+    _fork_child(void * _this) {
+        pthread_mutex_unlock(&(((io_buffer_pool *)_this)->lock));
+    }
+
+    // io_uring buffers the pool is registered as
+    uint64_t
+    nregistered() const {
+        return (nbufs * buf_size + reg_size - 1) >> log_reg_size;
+    }
+
+    // buf_index for READ_FIXED / WRITE_FIXED on buf (or anything inside it)
+    uint32_t ALWAYS_INLINE PURE_ATTR
+    buf_index(const void * buf) const {
+        return (((uint64_t)buf) - base) >> log_reg_size;
+    }
+
+    uint32_t ALWAYS_INLINE PURE_ATTR
+    owns(const void * buf) const {
+        return ((uint64_t)buf) - base < nbufs * buf_size;
+    }
+
+    // 0 or -errno of IORING_REGISTER_BUFFERS on ring_fd (EBUSY if the ring
+    // already has buffers, ENOMEM past RLIMIT_MEMLOCK)
+    int32_t
+    register_buffers(const int32_t ring_fd) {
+        const uint64_t n   = nregistered();
+        struct iovec * iov = (struct iovec *)malloc(n * sizeof(struct iovec));
+        ERROR_ASSERT(iov != NULL);
+        for (uint64_t i = 0; i < n; ++i) {
+            iov[i].iov_base = (void *)(base + i * reg_size);
+            iov[i].iov_len  = cmath::min<uint64_t>(
+                reg_size,
+                nbufs * buf_size - i * reg_size);
+        }
+        const int32_t ret = syscall(__NR_io_uring_register,
+                                    ring_fd,
+                                    IORING_REGISTER_BUFFERS,
+                                    iov,
+                                    (uint32_t)n) < 0
+                                ? -errno
+                                : 0;
+        free(iov);
+        return ret;
+    }
+
+    int32_t
+    unregister_buffers(const int32_t ring_fd) {
+        return syscall(__NR_io_uring_register,
+                       ring_fd,
+                       IORING_UNREGISTER_BUFFERS,
+                       NULL,
+                       0) < 0
+                   ? -errno
+                   : 0;
+    }
+
+    // a buf_size buffer, NULL if all are in use
+    void *
+    get() {
+        ensure_thread();
+        const uint64_t buf =
+            cache_t::template try_pop<_log_cpu_stride>(caches);
+        if (BRANCH_LIKELY(buf != 0)) {
+            return (void *)buf;
+        }
+        return _refill();
+    }
+
+    void
+    put(void * buf) {
+        IMPOSSIBLE_COND(!owns(buf));
+        ensure_thread();
+        if (BRANCH_LIKELY(!cache_t::template try_push<_log_cpu_stride>(
+                caches,
+                (uint64_t)buf))) {
+            return;
+        }
+        _spill((uint64_t)buf);
+    }
+
+    // cache was empty: half a cache from the stack, one to return and the
+    // rest cached
+    void *
+    _refill() {
+        uint64_t bufs[batch];
+        uint32_t n;
+        pthread_mutex_lock(&lock);
+        if (nstack == 0) {
+            _drain_all();
+        }
+        n = cmath::min<uint64_t>(nstack, batch);
+        nstack -= n;
+        memcpy(bufs, stack + nstack, n * sizeof(uint64_t));
+        pthread_mutex_unlock(&lock);
+
+        if (n == 0) {
+            return NULL;
+        }
+        uint32_t i = 1;
+        while (i < n && !cache_t::template try_push<_log_cpu_stride>(
+                            caches,
+                            bufs[i])) {
+            ++i;
+        }
+        // the cache filled up (another thread) or is being drained
+        if (i < n) {
+            pthread_mutex_lock(&lock);
+            memcpy(stack + nstack, bufs + i, (n - i) * sizeof(uint64_t));
+            nstack += n - i;
+            pthread_mutex_unlock(&lock);
+        }
+        return (void *)bufs[0];
+    }
+
+    // cache was full: buf and half the cache to the stack
+    void
+    _spill(const uint64_t buf) {
+        uint64_t bufs[batch];
+        uint32_t n = 0;
+        bufs[n++]  = buf;
+        while (n < batch) {
+            bufs[n] = cache_t::template try_pop<_log_cpu_stride>(caches);
+            if (bufs[n] == 0) {
+                break;
+            }
+            ++n;
+        }
+        pthread_mutex_lock(&lock);
+        memcpy(stack + nstack, bufs, n * sizeof(uint64_t));
+        nstack += n;
+        pthread_mutex_unlock(&lock);
+    }
+
+    // Moves everything cached on idx to the stack, stopped the same way as
+    // object_allocator::_stop_cpu. With lock held.
+    void
+    _drain_cpu(const uint32_t idx) {
+        cache_t * const c = caches + idx;
+        cache_t::stop(idx, 1, [c](uint32_t) { return c; });
+
+        const uint64_t n = c->current_idx & (~cache_t::STOPPED);
+        memcpy(stack + nstack, c->ptrs, n * sizeof(uint64_t));
+        nstack += n;
+        __atomic_store_n(&(c->current_idx), 0, __ATOMIC_RELEASE);
+    }
+
+    // with lock held
+    void
+    _drain_all() {
+        if (!rseq_fence_supported()) {
+            return;
+        }
+        for (uint32_t i = 0; i < nidx; ++i) {
+            if (__atomic_load_n(&(caches[i].current_idx), __ATOMIC_RELAXED)) {
+                _drain_cpu(i);
+            }
+        }
+    }
+
+    // buffers on the stack, cached ones aren't counted
+    uint64_t
+    nfree() const {
+        return __atomic_load_n(&nstack, __ATOMIC_RELAXED);
+    }
+};
+
+}  // namespace alloc
+
+#endif
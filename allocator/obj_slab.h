@@ -73,10 +73,18 @@ struct obj_slab {
 
 
     ~obj_slab() = default;
-    obj_slab(const uint32_t _block_size) : block_size(_block_size) {
+    // every header field is set, the memory may hold an old slab (reused
+    // by the filler or left by object_allocator::reset)
+    obj_slab(const uint32_t _block_size)
+        : next(NULL), block_size(_block_size), freed_vecs(0), state(OWNED) {
         const uint32_t nblocks = payload_size / _block_size;
         const uint32_t nslots  = (nblocks + 63) / 64;
 
+        memset(available_slots + nslots,
+               0,
+               (num_vecs - nslots) * sizeof(uint64_t));
+        memset(freed_slots, 0, sizeof(freed_slots));
+
 
         available_vecs = ((nslots >= 64) ? 0 : ((1UL) << nslots)) - 1;
                 
@@ -93,8 +101,12 @@ struct obj_slab {
     }
 
 
+    // head is the list this slab was taken from. The slab is only
+    // allocated from if it is still the head (another thread on this cpu
+    // may have moved it to a different list since it was read) and the
+    // list is not being drained, otherwise MIGRATED.
     uint64_t
-    _allocate(const uint32_t start_cpu) {
+    _allocate(const uint32_t start_cpu, obj_slab * const * head) {
 
         OBJ_SLAB_ASSERT((((uint64_t)this) % sizeof(obj_slab)) == 0);
         OBJ_SLAB_ASSERT((((uint64_t)this) % sizeof(obj_slab)) == 0);
@@ -134,6 +146,15 @@ struct obj_slab {
             // if migrated goto 2:
             "jnz 9f\n\t"            
 
+            // if no longer the head of this cpu's list goto 2:
+            "cmpq %[_this], (%[head])\n\t"
+            "jnz 9f\n\t"
+
+            // if the list is being drained goto 2: (16(head) is the free
+            // cache idx in the same slab_manager, see free_cache::STOPPED)
+            "cmpq $0, 16(%[head])\n\t"
+            "js 9f\n\t"
+
             // if not migrated temp_v = *v
             "movq (%[_this]), %[temp_av]\n\t"
             
@@ -202,7 +223,16 @@ struct obj_slab {
             // given that the critical section is fairly involved
             // it may be worth it to put this in the same code section
             // as critical section for faster aborts
+#if RSEQ_HYBRID_ABORTS
+            // too many aborts, report as migrated and let the caller
+            // decide (see object_allocator::_allocate_private)
+            "cmpl %[ABORT_LIMIT], %%fs:rseq_abort_count@tpoff\n\t"
+            "jb 1b\n\t"
+            "mov %[MIGRATED], %[idx]\n\t"
+            "jmp 9b\n\t"
+#else
             "jmp 1b\n\t"
+#endif
             RSEQ_END_ABORT_DEF()
 
             : [ idx] "=&r" (idx),
@@ -211,16 +241,39 @@ struct obj_slab {
               [ temp_av ] "=&r" (temp_av),
               [ av_clobber ] "=&m" (available_vecs),
               [ as_clobber ] "=&m" (available_slots)
-            : [ _this ] "r" (this),              
+            : [ _this ] "r" (this),
+              [ head ] "r" (head),
               [ MIGRATED ] "i" (MIGRATED),
               [ FULL ] "i" (FULL),
-              [ start_cpu ] "r" (start_cpu)
+              [ ABORT_LIMIT ] "i" (RSEQ_HYBRID_ABORTS),
+              [ start_cpu ] "r" (start_cpu),
+              RSEQ_AREA_OPERANDS()
             : "cc");
         // clang-format on
 
         return idx;
     }
 
+    // _allocate for a slab only the calling thread allocates from (so no
+    // rseq). Same return values
+    uint64_t
+    _allocate_private() {
+        uint64_t temp_av = available_vecs;
+        while (temp_av) {
+            const uint32_t idx_av  = bits::find_first_one<uint64_t>(temp_av);
+            const uint64_t temp_as = available_slots[idx_av];
+            if (temp_as == 0) {
+                temp_av &= (temp_av - 1);
+                continue;
+            }
+            available_vecs           = temp_av;
+            available_slots[idx_av] = temp_as & (temp_as - 1);
+            return 64 * idx_av + bits::find_first_one<uint64_t>(temp_as);
+        }
+        available_vecs = 0;
+        return FULL;
+    }
+
     // this function is quasi atomic.
     uint32_t
     _try_release() {
@@ -307,6 +360,44 @@ struct obj_slab {
         return atomic_bit_unset_ret((uint64_t *)(&state), 0);
     }
 
+    // objects allocatable without reclaiming frees (i.e what _allocate /
+    // _allocate_private hand out before the slab counts as full). Only
+    // stable while no one can allocate from the slab.
+    uint32_t
+    _num_available() const {
+        uint32_t navailable = 0;
+        for (uint64_t vecs = available_vecs; vecs; vecs &= (vecs - 1)) {
+            navailable += bits::bitcount<uint64_t>(
+                available_slots[bits::find_first_one<uint64_t>(vecs)]);
+        }
+        return navailable;
+    }
+
+    // 1 if every object is free and every free into the slab has set its
+    // freed_vecs bit (i.e nothing but a read of state is left of it). Only
+    // for a slab no one can allocate from (e.g one a drain took off its
+    // list); an empty slab stays empty as there is nothing left to free.
+    uint32_t
+    _is_empty() const {
+        const uint64_t nblocks = payload_size / block_size;
+        const uint64_t fvecs   = __atomic_load_n(&freed_vecs, __ATOMIC_ACQUIRE);
+
+        uint64_t nfree = 0;
+        for (uint32_t i = 0; i < num_vecs; ++i) {
+            const uint64_t fslots =
+                __atomic_load_n(freed_slots + i, __ATOMIC_RELAXED);
+            if (fslots && (!(fvecs & ((1UL) << i)))) {
+                return 0;
+            }
+            nfree += bits::bitcount<uint64_t>(fslots);
+            // vecs not in available_vecs have nothing available
+            if (available_vecs & ((1UL) << i)) {
+                nfree += bits::bitcount<uint64_t>(available_slots[i]);
+            }
+        }
+        return nfree == nblocks;
+    }
+
     void
     print_state_recap() {
         fprintf(stderr,
@@ -1,13 +1,24 @@
 #ifndef _OBJECT_ALLOCATOR_H_
 #define _OBJECT_ALLOCATOR_H_
 
+#include <fcntl.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <misc/cpp_attributes.h>
 
+#include <system/fork_hooks.h>
 #include <system/mmap_helpers.h>
 #include <system/sys_info.h>
+#include <timing/timers.h>
 
 #include <concurrency/bitvec_atomics.h>
 
+#include <allocator/hugepage_filler.h>
 #include <allocator/obj_slab.h>
 #include <allocator/slab_allocation.h>
 #include <allocator/slab_manager.h>
@@ -16,8 +27,66 @@
 
 #define OBJ_DBG_ASSERT(X) assert(X)
 
+// 1 -> slab_managers[NPROCS][classes], each cpu's managers for all size
+// classes are contiguous (fewer TLB entries / cache lines for mixed sizes)
+// 0 -> slab_managers[classes][NPROCS]
+#ifndef CPU_MAJOR_LAYOUT
+#define CPU_MAJOR_LAYOUT 1
+#endif
+
+// (only with CPU_MAJOR_LAYOUT) pad each cpu's managers to a page so that
+// a cpu's metadata is only committed once that cpu first touches it.
+#ifndef SPARSE_CPU_METADATA
+#define SPARSE_CPU_METADATA 1
+#endif
+
+// bytes of slabs each cpu takes from the shared region at a time and then
+// carves up itself (see object_allocator::_new_slab). 0 -> every new slab
+// comes from the shared region.
+#ifndef SLAB_CHUNK_SIZE
+#define SLAB_CHUNK_SIZE (2 * 1024 * 1024)
+#endif
+
+// 1 -> by default give each size class its own address range so objects
+// can be freed without reading their slab (see
+// new_memory::size_class_slab_allocator)
+#ifndef SIZE_CLASS_PARTITION
+#define SIZE_CLASS_PARTITION 0
+#endif
+
+// 1 -> back the region (slabs and metadata) with transparent huge pages
+// where the kernel allows it: the region is aligned to HUGE_PAGE_SIZE and
+// advised MADV_HUGEPAGE, so large heaps take far fewer dTLB entries. Costs
+// memory, each huge page is committed at once.
+#ifndef SLAB_HUGEPAGES
+#define SLAB_HUGEPAGES 0
+#endif
+
+// 1 -> allocations that still find no memory once the oom handler gave up
+// come from malloc instead of failing, and _free / usable_size hand
+// pointers outside the region to the system allocator (costs a range
+// check on every free). reset() doesn't free those.
+#ifndef SLAB_SYSTEM_FALLBACK
+#define SLAB_SYSTEM_FALLBACK 0
+#endif
+
+// allocations out of memory reclaim (see _out_of_memory) at most once per
+// this many us between them. Once the heap is full every allocation gets
+// there and would otherwise drain every cpu.
+#ifndef SLAB_OOM_RECLAIM_US
+#define SLAB_OOM_RECLAIM_US 1000
+#endif
+
 namespace alloc {
 
+#if SIZE_CLASS_PARTITION
+using default_slab_allocator_t =
+    new_memory::size_class_slab_allocator<obj_slab>;
+#else
+using default_slab_allocator_t =
+    new_memory::shared_memory_slab_allocator<obj_slab>;
+#endif
+
 
 template<typename slab_t>
 static constexpr uint64_t
@@ -44,26 +113,155 @@ calculate_end(uint64_t mem_region, uint64_t region_size) {
 }
 
 
-template<typename slab_t, typename slab_manager_t, typename slab_allocator_t>
+template<typename slab_t,
+         typename slab_manager_t,
+         typename slab_allocator_t,
+         typename filler_t>
 struct memory_layout {
 
-    slab_manager_t   slab_managers[num_size_classes][NPROCS];
+#if CPU_MAJOR_LAYOUT
+    // pad classes to power of 2 so cpu offset in rseq is just a shift
+#if SPARSE_CPU_METADATA
+    static constexpr uint32_t sm_classes = cmath::max<uint32_t>(
+        cmath::next_p2<uint32_t>(num_size_classes),
+        PAGE_SIZE / sizeof(slab_manager_t));
+    static constexpr uint64_t sm_align = PAGE_SIZE;
+#else
+    static constexpr uint32_t sm_classes =
+        cmath::next_p2<uint32_t>(num_size_classes);
+    static constexpr uint64_t sm_align = alignof(slab_manager_t);
+#endif
+    static constexpr uint64_t cpu_stride = sm_classes * sizeof(slab_manager_t);
+#else
+    static constexpr uint32_t sm_classes = num_size_classes;
+    static constexpr uint64_t sm_align   = alignof(slab_manager_t);
+    static constexpr uint64_t cpu_stride = sizeof(slab_manager_t);
+#endif
+
+    // object_allocator::heap_magic once the layout is set up, 0 before
+    // (first so a file that holds something else is unlikely to pass)
+    uint64_t magic;
+    // object_allocator::layout_config it was set up with
+    uint64_t config;
+    // where it was set up, everything in the region points into it
+    uint64_t region_start;
+    // used by several processes at once (see object_allocator's fd
+    // constructor)
+    const uint32_t multi_process;
+    // taken (after its own) by each process's maintenance if multi_process
+    pthread_mutex_t shared_maintenance_lock;
+
     slab_allocator_t slab_allocator;
 
     // this is not meant to be particularly efficient to access, mostly for
     // destruction / reset
     const uint64_t raw_region_size;
 
-    memory_layout(void * mem_region, uint64_t region_size)
-        : slab_allocator(calculate_start<slab_t>(
-              ((uint64_t)mem_region) +
-              sizeof(memory_layout<slab_t, slab_manager_t, slab_allocator_t>))),
-          raw_region_size(region_size) {}
+    // number of cpus (or per-thread indexes with rseq_fallback)
+    // slab_managers is sized for. Only known at runtime so the managers are
+    // the trailing member
+    const uint32_t nprocs;
+
+    // bumped on every reset so that per-thread state referring to slabs
+    // from before can tell
+    const uint64_t generation;
+
+    // cpus this process could run on as of the last resync. Managers of
+    // cpus outside this set are drained and (with SPARSE_CPU_METADATA)
+    // never committed. With mm_cid indexing only indexes < nreachable are
+    // used.
+    sysi::cpu_mask_t reachable;
+    uint32_t         nreachable;
+
+    // empty slabs drains took back, reused before new ones are carved.
+    // Its per huge page state is at the end of the region (past the last
+    // slab).
+    filler_t filler;
+
+    // whatever the user of a file backed heap wants the next process to
+    // find (e.g the root of its objects), NULL after reset
+    void * root;
+
+#if CPU_MAJOR_LAYOUT
+    // slab_managers[nprocs][sm_classes]
+    slab_manager_t slab_managers[][sm_classes] ALIGN_ATTR(sm_align);
+#else
+    // slab_managers[num_size_classes][nprocs]
+    slab_manager_t slab_managers[] ALIGN_ATTR(sm_align);
+#endif
+
+    // header (padded to sm_align) + managers for _nprocs cpus
+    static constexpr uint64_t
+    size(const uint32_t _nprocs) {
+        return sizeof(memory_layout) +
+               ((uint64_t)_nprocs) * sm_classes * sizeof(slab_manager_t);
+    }
+
+    // end of the slabs' part of the region, the filler's per huge page
+    // state is after it
+    static constexpr uint64_t
+    slabs_end(const uint64_t mem_region, const uint64_t region_size) {
+        return mem_region + region_size -
+               filler_t::state_size(mem_region, mem_region + region_size);
+    }
+
+    // slab_managers are not initialized here. The region is fresh (or
+    // dropped) memory so they start zeroed and untouched. magic is left
+    // to object_allocator. drop_advice is how the filler gives memory back
+    // (see hugepage_filler).
+    memory_layout(void *   mem_region,
+                  uint64_t region_size,
+                  uint32_t _nprocs,
+                  uint64_t _generation,
+                  int32_t  drop_advice,
+                  uint32_t _multi_process)
+        : region_start((uint64_t)mem_region),
+          multi_process(_multi_process),
+          slab_allocator(
+              calculate_start<slab_t>(((uint64_t)mem_region) + size(_nprocs)),
+              slabs_end((uint64_t)mem_region, region_size),
+              new_memory::slab_numa_nodes()),
+          raw_region_size(region_size),
+          nprocs(_nprocs),
+          generation(_generation),
+          filler((uint64_t)mem_region,
+                 slabs_end((uint64_t)mem_region, region_size),
+                 (typename filler_t::hp_state *)slabs_end(
+                     (uint64_t)mem_region,
+                     region_size),
+                 drop_advice),
+          root(NULL) {
+        nreachable = sysi::reachable_cpus(&reachable);
+    }
+
+    uint64_t ALWAYS_INLINE PURE_ATTR
+    meta_size() const {
+        return size(nprocs);
+    }
+
+    // manager for cpu 0. In rseq manager for cpu is at
+    // sm_base + (cpu << log2(cpu_stride))
+    ALWAYS_INLINE slab_manager_t *
+    sm_base(const uint32_t size_idx) {
+#if CPU_MAJOR_LAYOUT
+        return slab_managers[0] + size_idx;
+#else
+        return slab_managers + size_idx * nprocs;
+#endif
+    }
+
+    ALWAYS_INLINE slab_manager_t *
+    get_sm(const uint32_t cpu, const uint32_t size_idx) {
+#if CPU_MAJOR_LAYOUT
+        return slab_managers[cpu] + size_idx;
+#else
+        return slab_managers + size_idx * nprocs + cpu;
+#endif
+    }
 };
 
 template<uint32_t cache_size_lower_bound = 13,
-         typename slab_allocator_t =
-             new_memory::shared_memory_slab_allocator<obj_slab>>
+         typename slab_allocator_t = default_slab_allocator_t>
 struct object_allocator {
 
 
@@ -76,40 +274,623 @@ struct object_allocator {
 
     using slab_t         = obj_slab;
     using slab_manager_t = slab_manager<slab_t, cache_size>;
+
+    // a free slab can be reused by any size class on its node unless
+    // classes have their own address range
+    static constexpr uint32_t filler_class_sets =
+        slab_allocator_t::partitioned ? num_size_classes : 1;
+    using filler_t =
+        hugepage_filler<slab_t, SLAB_NUMA_NODES * filler_class_sets>;
+
     using memory_layout_t =
-        memory_layout<slab_t, slab_manager_t, slab_allocator_t>;
+        memory_layout<slab_t, slab_manager_t, slab_allocator_t, filler_t>;
 
-    // will default to approximately a few gb of unreserve memory
-    static constexpr uint64_t default_region_size = ((1UL) << 31);
+    static constexpr uint64_t default_region_size =
+        slab_allocator_t::default_region_size;
+    static constexpr uint64_t region_align = cmath::max<uint64_t>(
+        slab_allocator_t::region_align,
+        SLAB_HUGEPAGES ? HUGE_PAGE_SIZE : PAGE_SIZE);
 
     static constexpr uint64_t _log_sizeof_slab_manager =
         cmath::ulog2<uint64_t>(sizeof(slab_manager_t));
 
+    static constexpr uint64_t _log_cpu_stride =
+        cmath::ulog2<uint64_t>(memory_layout_t::cpu_stride);
+    static_assert((1UL << _log_cpu_stride) == memory_layout_t::cpu_stride);
+
+    static constexpr uint64_t fc_stopped = free_cache<cache_size>::STOPPED;
+
+    // slab_manager::chunk is the next slab in the low 56 bits and how many
+    // are left in the top 8. A chunk is as many whole slabs as fit in
+    // SLAB_CHUNK_SIZE. Slabs are not a power of 2 in size so chunks can't
+    // start or end on huge page boundaries, each cpu's run of slabs shares
+    // the huge page at either end with its neighbours'.
+    static constexpr uint64_t chunk_left_shift = 56;
+    static constexpr uint64_t chunk_one_left   = (1UL) << chunk_left_shift;
+    static constexpr uint64_t chunk_slabs      = cmath::min<uint64_t>(
+        cmath::max<uint64_t>(SLAB_CHUNK_SIZE / sizeof(slab_t), 1),
+        (1UL << (64 - chunk_left_shift)) - 1);
+
+    // "slabheap", see memory_layout::magic
+    static constexpr uint64_t heap_magic = 0x70616568626c6173UL;
+    // what decides the layout of the region beyond its size, address and
+    // nprocs (all checked before attaching to a file backed heap)
+    static constexpr uint64_t layout_config =
+        sizeof(memory_layout_t) | (((uint64_t)sizeof(slab_t)) << 24) |
+        (((uint64_t)cache_size) << 44) |
+        (((uint64_t)slab_allocator_t::partitioned) << 52) |
+        (((uint64_t)CPU_MAJOR_LAYOUT) << 53) |
+        (((uint64_t)SLAB_NUMA_NODES) << 56);
+
 
     memory_layout_t * const m;
     const uint64_t          end;
+    // region is a MAP_SHARED mapping of a file this mapped (see the fd
+    // constructor), possibly used by other processes at the same time
+    const uint32_t file_backed;
+    const uint32_t multi_process;
+    // how memory is given back, see madv_release
+    const int32_t drop_advice;
+    // in a forked child of a single process file backed heap, which has
+    // no access to the region (see _fork_child)
+    uint32_t forked_away;
+
+    // held by anything that rewrites other cpus' managers (drain_cpu,
+    // resync_cpus, reset) and across fork so the child never sees one half
+    // done (e.g a cpu left STOPPED with no one to restart it). See
+    // _lock_maintenance.
+    pthread_mutex_t maintenance_lock;
+    fork_hooks      fork_node;
+
+    // see set_memory_limits
+    static constexpr uint64_t no_limit = (~(0UL));
+    enum LIMIT { GROW = 0, RETRY = 1, DENY = 2 };
+
+    // Called when an allocation found no memory (region used up or hard
+    // limit) even after reclaiming, see _out_of_memory. Returns non-zero
+    // to have it retried (e.g it freed memory or raised the limit), 0 to
+    // let it fail (or go to malloc with SLAB_SYSTEM_FALLBACK). usage is
+    // memory_usage(), size the allocation's.
+    typedef uint32_t (*oom_handler_t)(void *   arg,
+                                      uint64_t usage,
+                                      uint64_t size);
+
+    uint64_t      soft_limit;
+    uint64_t      hard_limit;
+    // usage past the soft limit at which to reclaim again
+    uint64_t      reclaim_next;
+    // time (timers::get_ns) from which running out of memory reclaims
+    // again
+    uint64_t      oom_reclaim_next;
+    oom_handler_t oom_handler;
+    void *        oom_arg;
+    // allocations that went to malloc (SLAB_SYSTEM_FALLBACK)
+    uint64_t nsystem_allocs;
+
+
+    // Allocators not yet destroyed. A thread's hybrid_state can outlive
+    // its owner and only hands slabs back to one that is still here (see
+    // hybrid_state::release). id tells a new allocator apart from a
+    // destroyed one at the same address.
+    struct live_list {
+        pthread_mutex_t    lock;
+        object_allocator * head;
+        uint64_t           next_id;
+        fork_hooks         fork_node;
+    };
+    static live_list   live;
+    object_allocator * live_next;
+    uint64_t           live_id;
+
+    // Slabs a thread allocates from without rseq, per node, once it has
+    // aborted too often or for allocations hinted to another node (see
+    // _allocate_private), and slabs it gave up sending to its cpu (see
+    // _send_slab). Handed back to the thread's current cpu when it exits.
+    struct hybrid_state {
+        object_allocator * owner;
+        uint64_t           owner_id;
+        uint64_t           generation;
+        slab_t *           slabs[SLAB_NUMA_NODES][num_size_classes];
+        // linked through next
+        slab_t * parked;
+
+        void
+        release() {
+            if (owner == NULL) {
+                return;
+            }
+            // held until the slabs are sent so owner can't be destroyed
+            // meanwhile
+            pthread_mutex_lock(&(live.lock));
+            // a reset since took the slabs, a destroyed owner's are gone
+            // with it
+            const uint32_t keep = _is_live(owner, owner_id) &&
+                                  generation == owner->m->generation;
+            for (uint32_t n = 0; n < SLAB_NUMA_NODES; ++n) {
+                for (uint32_t i = 0; i < num_size_classes; ++i) {
+                    slab_t * slab = slabs[n][i];
+                    slabs[n][i]   = NULL;
+                    if (slab == NULL || !keep) {
+                        continue;
+                    }
+                    slab->next = NULL;
+                    owner->_send_slab(slab, i, 0);
+                }
+            }
+            while (parked != NULL) {
+                slab_t * slab = parked;
+                parked        = slab->next;
+                if (keep) {
+                    slab->next = NULL;
+                    owner->_send_slab(slab,
+                                      owner->addr_to_size_idx((void *)slab),
+                                      0);
+                }
+            }
+            pthread_mutex_unlock(&(live.lock));
+            owner = NULL;
+        }
+
+        ~hybrid_state() {
+            release();
+        }
+    };
+    static thread_local hybrid_state hybrid;
+
+    // with live.lock held
+    static uint32_t
+    _is_live(const object_allocator * oa, const uint64_t id) {
+        object_allocator * it = live.head;
+        while (it != NULL && it != oa) {
+            it = it->live_next;
+        }
+        return it != NULL && it->live_id == id;
+    }
+
+    void
+    _add_live() {
+        static pthread_once_t hooks_once = PTHREAD_ONCE_INIT;
+        pthread_once(&hooks_once, _add_live_fork_hooks);
+
+        pthread_mutex_lock(&(live.lock));
+        live_id   = ++live.next_id;
+        live_next = live.head;
+        live.head = this;
+        pthread_mutex_unlock(&(live.lock));
+    }
+
+    void
+    _remove_live() {
+        pthread_mutex_lock(&(live.lock));
+        object_allocator ** it = &(live.head);
+        while (*it != this) {
+            it = &((*it)->live_next);
+        }
+        *it = live_next;
+        pthread_mutex_unlock(&(live.lock));
+    }
+
+    // added before any allocator's own hooks so live.lock is taken first
+    static void
+    _add_live_fork_hooks() {
+        live.fork_node = {
+            _live_fork_prepare, _live_fork_release, _live_fork_release,
+            NULL,               NULL,               NULL
+        };
+        add_fork_hooks(&(live.fork_node));
+    }
+
+    static void
+    _live_fork_prepare(void * unused) {
+        (void)(unused);
+        pthread_mutex_lock(&(live.lock));
+    }
+
+    static void
+    _live_fork_release(void * unused) {
+        (void)(unused);
+        pthread_mutex_unlock(&(live.lock));
+    }
 
 
     object_allocator()
-        : object_allocator(mmap_alloc_noreserve(default_region_size),
-                           default_region_size) {}
+        : object_allocator(
+              mmap_alloc_aligned_noreserve(default_region_size, region_align),
+              default_region_size) {}
 
     object_allocator(uint64_t region_size)
-        : object_allocator(mmap_alloc_reserve(region_size), region_size) {}
-
+        : object_allocator(
+              mmap_alloc_aligned_reserve(region_size, region_align),
+              region_size) {}
+
+
+    // Heap in a file (or memfd) that outlives the process: the region is
+    // fd mapped MAP_SHARED at exactly addr (which must be free and
+    // aligned to region_align). An empty file is sized to region_size and
+    // set up, one that holds a heap from an earlier process is attached to
+    // as it is (see _attach), e.g by a restarted server handed the memfd.
+    // memory_layout::root is for finding the objects again. Attaching
+    // needs the same build (layout_config), region_size, addr and number
+    // of cpus. fd may be closed afterwards. Without _multi_process only
+    // one process may use the heap at a time (a forked child can't, see
+    // _fork_child).
+    //
+    // _multi_process -> every process that opens the file this way shares
+    // the heap at once: objects allocated in one can be freed in any
+    // other (e.g handed over through a queue in shared memory). The region
+    // is at the same address everywhere so the raw pointers in it (slab
+    // lists, free caches, chunks) need no translating. Per-cpu caches
+    // have to be indexed by cpu id (RSEQ_USE_MM_CID=0, mm_cid is per
+    // process) so rseq keeps each cpu's critical sections exclusive
+    // whichever process they are in. Draining a cpu runs the draining
+    // thread there (see _stop_cpu) so a process only drains cpus it can
+    // run on. The locks in the region are process shared, setting up /
+    // attaching is serialized with flock. reset() is not allowed. A process
+    // dying in maintenance or with the filler's lock held is recovered
+    // from (see _shared_lock_taken and hugepage_filler::recover).
+    object_allocator(int32_t  fd,
+                     void *   addr,
+                     uint64_t region_size,
+                     uint32_t _multi_process = 0)
+        : object_allocator(fd, addr, region_size, _multi_process, 0) {}
+
+    // same for the file at path (created if it doesn't exist)
+    object_allocator(const char * path,
+                     void *       addr,
+                     uint64_t     region_size,
+                     uint32_t     _multi_process = 0)
+        : object_allocator(_open_file(path),
+                           addr,
+                           region_size,
+                           _multi_process,
+                           1) {}
+
+    object_allocator(int32_t  fd,
+                     void *   addr,
+                     uint64_t region_size,
+                     uint32_t _multi_process,
+                     uint32_t close_fd)
+        : object_allocator(_map_file(fd, addr, region_size),
+                           region_size,
+                           fd,
+                           close_fd,
+                           _multi_process) {}
 
     object_allocator(void * mem, uint64_t region_size)
+        : object_allocator(mem, region_size, -1, 0, 0) {}
+
+    // fd -> mem is fd mapped MAP_SHARED, -1 for anonymous memory
+    object_allocator(void *   mem,
+                     uint64_t region_size,
+                     int32_t  fd,
+                     uint32_t close_fd,
+                     uint32_t _multi_process)
         : m((memory_layout_t * const)mem),
-          end(calculate_end<slab_t>(((uint64_t)m) + sizeof(memory_layout_t),
-                                    region_size - sizeof(memory_layout_t))) {
-
-        new (m) memory_layout_t(m, region_size);
+          end(calculate_end<slab_t>(
+              ((uint64_t)m) + memory_layout_t::size(rseq_num_idx(NPROCS)),
+              memory_layout_t::slabs_end(((uint64_t)mem), region_size) -
+                  (((uint64_t)m) +
+                   memory_layout_t::size(rseq_num_idx(NPROCS))))),
+          file_backed(fd >= 0),
+          multi_process(_multi_process),
+          drop_advice(fd >= 0 ? MADV_REMOVE : MADV_DONTNEED),
+          forked_away(0),
+          soft_limit(no_limit),
+          hard_limit(no_limit),
+          reclaim_next(0),
+          oom_reclaim_next(0),
+          oom_handler(NULL),
+          oom_arg(NULL),
+          nsystem_allocs(0) {
+
+        DIE_ASSERT(((uint64_t)mem) % region_align == 0,
+                   "Error region %p is not aligned to %lu\n",
+                   mem,
+                   region_align);
+#if SLAB_HUGEPAGES
+        if (TRANSPARENT_HUGE_PAGE_CFG != THP::NEVER) {
+            try_hugepage(mem, region_size);
+        }
+#endif
+        DIE_ASSERT(!multi_process ||
+                       (rseq_idx_is_cpu() && !SLAB_SYSTEM_FALLBACK),
+                   "Error a multi process heap needs per-cpu indexes by cpu "
+                   "id (RSEQ_USE_MM_CID=0, no rseq fallback) and no "
+                   "SLAB_SYSTEM_FALLBACK\n");
+        ERROR_ASSERT(!pthread_mutex_init(&maintenance_lock, NULL));
+        if (file_backed) {
+            ERROR_ASSERT(!flock(fd, LOCK_EX), "Error locking heap file\n");
+        }
+        const uint32_t attach =
+            file_backed && __atomic_load_n(&(m->magic), __ATOMIC_ACQUIRE);
+        if (attach) {
+            _attach(region_size);
+        }
+        else {
+            if (file_backed) {
+                // whatever a process that died setting it up left
+                madv_release(mem, region_size, drop_advice);
+            }
+            new (m) memory_layout_t(m,
+                                    region_size,
+                                    rseq_num_idx(NPROCS),
+                                    0,
+                                    drop_advice,
+                                    multi_process);
+            if (multi_process) {
+                _init_shared_locks();
+            }
+            _stop_no_idx();
+            m->config = layout_config;
+            __atomic_store_n(&(m->magic), heap_magic, __ATOMIC_RELEASE);
+        }
+        if (file_backed) {
+            flock(fd, LOCK_UN);
+            if (close_fd) {
+                close(fd);
+            }
+        }
         OBJ_DBG_ASSERT(end % sizeof(slab_t) == 0);
-    }
+#if SLAB_NUMA_NODES > 1
+        // survives reset (the policy is on the mapping, not the pages)
+        if (m->slab_allocator.nnodes > 1) {
+            m->slab_allocator.for_each_node_range(
+                [](uint32_t node, uint64_t lo, uint64_t hi) {
+                    lo = cmath::roundup<uint64_t>(lo, PAGE_SIZE);
+                    hi = cmath::roundup<uint64_t>(hi, PAGE_SIZE);
+                    if (hi > lo) {
+                        try_mbind_node((void *)lo, hi - lo, node);
+                    }
+                });
+        }
+#endif
+
+        _add_live();
+        fork_node = {
+            _fork_prepare, _fork_parent, _fork_child, this, NULL, NULL
+        };
+        add_fork_hooks(&fork_node);
 
+        if (attach && !multi_process) {
+            // the cpus the old process could use may not all be ours
+            ensure_thread();
+            resync_cpus();
+        }
+    }
 
+    // a file backed heap is left as it is for the next process (or the
+    // others)
     ~object_allocator() {
-        madv_free((void *)m, get_raw_region_size());
+        remove_fork_hooks(&fork_node);
+        _remove_live();
+        // other threads' private slabs are dropped once they see this is
+        // gone, this one's can be now
+        if (hybrid.owner == this) {
+            memset(hybrid.slabs, 0, sizeof(hybrid.slabs));
+            hybrid.parked = NULL;
+            hybrid.owner  = NULL;
+        }
+        pthread_mutex_destroy(&maintenance_lock);
+        if (!file_backed) {
+            pthread_mutex_destroy(&(m->filler.lock));
+            madv_free((void *)m, get_raw_region_size());
+        }
+        else if (!forked_away) {
+            safe_munmap((void *)m, get_raw_region_size());
+        }
+    }
+
+    static void *
+    _map_file(const int32_t fd, void * addr, const uint64_t region_size) {
+        struct stat st;
+        ERROR_ASSERT(!fstat(fd, &st), "Error stat of heap fd %d\n", fd);
+        if (st.st_size == 0) {
+            ERROR_ASSERT(!ftruncate(fd, region_size),
+                         "Error sizing heap file to %lu\n",
+                         region_size);
+        }
+        else {
+            DIE_ASSERT(((uint64_t)st.st_size) == region_size,
+                       "Error heap file is %lu bytes, region is %lu\n",
+                       (uint64_t)st.st_size,
+                       region_size);
+        }
+        DIE_ASSERT(((uint64_t)addr) % region_align == 0,
+                   "Error region %p is not aligned to %lu\n",
+                   addr,
+                   region_align);
+        return mmap_file_fixed(addr, region_size, fd);
+    }
+
+    static int32_t
+    _open_file(const char * path) {
+        const int32_t fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        ERROR_ASSERT(fd >= 0, "Error opening heap file %s\n", path);
+        return fd;
+    }
+
+    // Takes over the heap an earlier process left in the region. Nothing of
+    // that process is running but it may have died anywhere: slabs its
+    // threads held privately (see hybrid_state) keep their objects but
+    // their free space is lost, a cpu it was draining is recovered as in
+    // _clear_stopped and the filler is rebuilt (hugepage_filler::recover).
+    // A multi process heap is just checked, the others are still using
+    // it.
+    void
+    _attach(const uint64_t region_size) {
+        DIE_ASSERT(m->magic == heap_magic && m->config == layout_config &&
+                       m->region_start == ((uint64_t)m) &&
+                       m->raw_region_size == region_size &&
+                       m->nprocs == rseq_num_idx(NPROCS) &&
+                       m->multi_process == multi_process,
+                   "Error region at %p does not hold a heap this build can "
+                   "attach to\n",
+                   m);
+        if (!multi_process) {
+            ERROR_ASSERT(!pthread_mutex_init(&(m->filler.lock), NULL));
+            m->filler.recover();
+            _clear_stopped();
+        }
+    }
+
+    // the filler's lock and shared_maintenance_lock are used by every
+    // process of a multi process heap, both robust (see
+    // hugepage_filler::_lock and _shared_lock_taken)
+    void
+    _init_shared_locks() {
+        pthread_mutexattr_t attr;
+        ERROR_ASSERT(!pthread_mutexattr_init(&attr));
+        ERROR_ASSERT(
+            !pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED));
+        ERROR_ASSERT(!pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST));
+        pthread_mutex_destroy(&(m->filler.lock));
+        ERROR_ASSERT(!pthread_mutex_init(&(m->filler.lock), &attr));
+        ERROR_ASSERT(
+            !pthread_mutex_init(&(m->shared_maintenance_lock), &attr));
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    // Empties the caches of every cpu left STOPPED by a drain (or prewarm)
+    // that will never finish as its process is gone, leaking what was
+    // cached rather than risking handing an object out twice. Stopped
+    // caches are changed by no one else.
+    void
+    _clear_stopped() {
+        for (uint32_t i = 0; i < m->nprocs; ++i) {
+            for (uint32_t size_idx = 0; size_idx < num_size_classes;
+                 ++size_idx) {
+                uint64_t * idx = &(m->get_sm(i, size_idx)->fc.current_idx);
+                if (__atomic_load_n(idx, __ATOMIC_RELAXED) & fc_stopped) {
+                    __atomic_store_n(idx, 0, __ATOMIC_RELEASE);
+                }
+            }
+        }
+        _stop_no_idx();
+    }
+
+    // With rseq_fallback index 0 is what threads without an index of their
+    // own see. Its caches are always STOPPED so the fast paths fail there
+    // and the slow paths take the shared index instead (see
+    // _allocate_no_idx). Never drained or prewarmed.
+    void
+    _stop_no_idx() {
+        if (rseq_fallback) {
+            _set_stopped(rseq_fallback_no_idx);
+        }
+    }
+
+    static uint32_t ALWAYS_INLINE
+    _is_no_idx(const uint32_t cpu) {
+        return rseq_fallback && cpu == rseq_fallback_no_idx;
+    }
+
+    // maintenance_lock, then with a multi process heap the one in the
+    // region every process's maintenance takes
+    void
+    _lock_maintenance() {
+        pthread_mutex_lock(&maintenance_lock);
+        if (multi_process) {
+            _shared_lock_taken(
+                pthread_mutex_lock(&(m->shared_maintenance_lock)));
+        }
+    }
+
+    // 0 if taken
+    uint32_t
+    _trylock_maintenance() {
+        if (pthread_mutex_trylock(&maintenance_lock)) {
+            return 1;
+        }
+        if (multi_process) {
+            const int32_t r =
+                pthread_mutex_trylock(&(m->shared_maintenance_lock));
+            if (r == EBUSY) {
+                pthread_mutex_unlock(&maintenance_lock);
+                return 1;
+            }
+            _shared_lock_taken(r);
+        }
+        return 0;
+    }
+
+    void
+    _unlock_maintenance() {
+        if (multi_process) {
+            pthread_mutex_unlock(&(m->shared_maintenance_lock));
+        }
+        pthread_mutex_unlock(&maintenance_lock);
+    }
+
+    // Waiting for a drain of a cpu to finish. In a multi process heap the
+    // drainer may have been killed: nothing unstops the cpu until someone
+    // takes the maintenance lock, so the waiter takes it itself (unless a
+    // live drainer has it).
+    void
+    _wait_stopped() {
+        if (multi_process && !_trylock_maintenance()) {
+            _unlock_maintenance();
+        }
+        sched_yield();
+    }
+
+    // shared_maintenance_lock is robust: if its owner died (its process
+    // was killed) the cpus it may have left STOPPED are recovered
+    void
+    _shared_lock_taken(const int32_t r) {
+        if (r == EOWNERDEAD) {
+            _clear_stopped();
+            ERROR_ASSERT(
+                !pthread_mutex_consistent(&(m->shared_maintenance_lock)));
+            return;
+        }
+        DIE_ASSERT(!r, "Error taking the heap's maintenance lock (%d)\n", r);
+    }
+
+    // Everything an rseq critical section does commits with one store, so
+    // whatever other threads were doing on their cpus when fork was called
+    // the child's managers are consistent. A thread that was between
+    // critical sections (e.g holding a slab it was about to send) just
+    // loses that slab in the child. Only maintenance has to be excluded.
+    // A file backed region is shared with the child, the filler is never
+    // seen half done there (its lock isn't the child's to release either).
+    static void
+    _fork_prepare(void * _this) {
+        object_allocator * oa = (object_allocator *)_this;
+        pthread_mutex_lock(&(oa->maintenance_lock));
+        if (!oa->file_backed) {
+            pthread_mutex_lock(&(oa->m->filler.lock));
+        }
+    }
+
+    static void
+    _fork_parent(void * _this) {
+        object_allocator * oa = (object_allocator *)_this;
+        if (!oa->file_backed) {
+            pthread_mutex_unlock(&(oa->m->filler.lock));
+        }
+        pthread_mutex_unlock(&(oa->maintenance_lock));
+    }
+
+    // The forking thread is the only one left and still holds the locks.
+    // A file backed heap that isn't _multi_process can't be used by the
+    // child: the region is the parent's (the same pages, not a copy) and
+    // the parent goes on using it. The child's mapping is made
+    // inaccessible so any use there faults right away instead of
+    // corrupting the parent's heap. The child can still exec or exit
+    // (destroying the allocator is fine).
+    static void
+    _fork_child(void * _this) {
+        object_allocator * oa = (object_allocator *)_this;
+        if (!oa->file_backed) {
+            pthread_mutex_unlock(&(oa->m->filler.lock));
+        }
+        else if (!oa->multi_process) {
+            ERROR_ASSERT(!mprotect((void *)oa->m,
+                                   oa->get_raw_region_size(),
+                                   PROT_NONE));
+            oa->forked_away = 1;
+        }
+        pthread_mutex_unlock(&(oa->maintenance_lock));
     }
 
     uint64_t ALWAYS_INLINE PURE_ATTR
@@ -119,21 +900,94 @@ struct object_allocator {
 
     uint64_t ALWAYS_INLINE PURE_ATTR
     get_slab_region_size() const {
-        return end -
-               calculate_start<slab_t>(((uint64_t)m) + sizeof(memory_layout_t));
+        return end - calculate_start<slab_t>(((uint64_t)m) + m->meta_size());
+    }
+
+    uint64_t ALWAYS_INLINE PURE_ATTR
+    get_meta_region_size() const {
+        return cmath::roundup<uint64_t>(m->meta_size(), PAGE_SIZE);
     }
 
+    // Frees every object at once and rewinds the region to empty. By
+    // default the pages of the slabs handed out go back to the os (a few
+    // madvise calls however much was allocated, the next allocations fault
+    // them in again). keep_memory leaves them mapped so reset only touches
+    // the metadata, for arena style use where the next phase reuses the
+    // memory right away (objects then start out with whatever was there,
+    // as after any free).
     void
-    reset() {
+    reset(const uint32_t keep_memory = 0) {
         const uint64_t region_size = get_raw_region_size();
-        memset((void *)m, 0, region_size);
-        new (m) memory_layout_t(m, region_size);
+        const uint64_t meta_size   = get_meta_region_size();
+        const uint32_t nprocs      = m->nprocs;
+        const uint64_t generation  = m->generation;
+
+        DIE_ASSERT(!multi_process,
+                   "Error reset of a heap other processes may be using\n");
+        _lock_maintenance();
+        // only slabs that were handed out were touched (the region may be
+        // mostly untouched address space)
+        if (!keep_memory) {
+            m->slab_allocator.release_used(drop_advice);
+        }
+        m->filler.clear();
+        reclaim_next     = 0;
+        oom_reclaim_next = 0;
+        // drop rather than zero the metadata so each cpu's managers are only
+        // committed again once that cpu allocates
+        madv_release((void *)m, meta_size, drop_advice);
+        new (m) memory_layout_t(m,
+                                region_size,
+                                nprocs,
+                                generation + 1,
+                                drop_advice,
+                                0);
+        _stop_no_idx();
+        m->config = layout_config;
+        __atomic_store_n(&(m->magic), heap_magic, __ATOMIC_RELEASE);
+#if SLAB_HUGEPAGES
+        // dropping the metadata split the huge page(s) it shares with the
+        // first slabs
+        _collapse(((uint64_t)m), meta_size);
+#endif
+        _unlock_maintenance();
+    }
+
+    // MADV_COLLAPSE every huge page of the metadata and the slabs handed
+    // out so far. Only needed for memory that was faulted in as small pages
+    // (e.g no huge page was free at the time, or SLAB_HUGEPAGES is off),
+    // fresh memory in an advised region already faults in huge pages.
+    // Synchronous and can be slow, meant for maintenance / after warm up.
+    // Returns how many ranges were fully collapsed.
+    uint32_t
+    collapse_hugepages() {
+        uint32_t ncollapsed = _collapse(((uint64_t)m), get_meta_region_size());
+        m->slab_allocator.for_each_used([&](uint64_t lo, uint64_t bytes) {
+            ncollapsed += _collapse(lo, bytes);
+        });
+        return ncollapsed;
     }
 
-    uint64_t CONST_ATTR
+    // collapse the huge pages covering [lo, lo + bytes) that are entirely
+    // in the region (all of them with SLAB_HUGEPAGES)
+    uint32_t
+    _collapse(const uint64_t lo, const uint64_t bytes) {
+        const uint64_t hp_lo = cmath::max<uint64_t>(
+            cmath::rounddown<uint64_t>(lo, HUGE_PAGE_SIZE),
+            cmath::roundup<uint64_t>(((uint64_t)m), HUGE_PAGE_SIZE));
+        const uint64_t hp_hi = cmath::min<uint64_t>(
+            cmath::roundup<uint64_t>(lo + bytes, HUGE_PAGE_SIZE),
+            cmath::rounddown<uint64_t>(((uint64_t)m) + get_raw_region_size(),
+                                       HUGE_PAGE_SIZE));
+        if (hp_hi <= hp_lo) {
+            return 0;
+        }
+        return try_collapse((void *)hp_lo, hp_hi - hp_lo);
+    }
+
+    uint64_t PURE_ATTR
     max_objects() const {
-        const uint64_t slabs_start = (uint64_t)(m + 1);
-        const uint64_t nslabs      = slabs_start / sizeof(obj_slab);
+        const uint64_t nslabs = get_slab_region_size() / sizeof(slab_t);
         return nslabs * obj_slab::capacity;
     }
 
@@ -148,9 +1002,44 @@ struct object_allocator {
     }
 
 
-#define SEND_SLAB_BRANCHES 1
-    void
-    _send_slab(slab_t * slab, const uint32_t size_idx) {
+    // Pushes slab on the current cpu's list. The only store before the
+    // commit is to slab->next which no one else can see yet, so an abort
+    // (possibly restarting on another cpu) leaves no list half linked.
+    // Waits out a drain of the list (there is nowhere else to put slab).
+    // After RSEQ_HYBRID_ABORTS aborts slab is parked with the thread
+    // instead (if may_park) and sent again on its next allocation that
+    // leaves the fast path (see _send_parked). Returns 1 if parked.
+    uint32_t
+    _send_slab(slab_t *       slab,
+               const uint32_t size_idx,
+               const uint32_t may_park = 1) {
+        while (1) {
+            const uint32_t r =
+                _try_send_slab(slab,
+                               size_idx,
+                               rseq_abort_count + RSEQ_HYBRID_ABORTS);
+            if (BRANCH_LIKELY(r == SEND_OK)) {
+                return 0;
+            }
+            if (r == SEND_ABORTED && may_park && _park_slab(slab)) {
+                return 1;
+            }
+            if (r == SEND_STOPPED) {
+                _wait_stopped();
+            }
+            else {
+                sched_yield();
+            }
+        }
+    }
+
+    enum SEND { SEND_OK = 0, SEND_STOPPED = 1, SEND_ABORTED = 2 };
+
+    // SEND_ABORTED once rseq_abort_count reaches abort_limit
+    uint32_t
+    _try_send_slab(slab_t *       slab,
+                   const uint32_t size_idx,
+                   const uint32_t abort_limit) {
 
         OBJ_DBG_ASSERT(slab->next == NULL);
         static_assert(slab_t::next_offset == OBJ_SLAB_NEXT_OFFSET);
@@ -158,17 +1047,11 @@ struct object_allocator {
 #pragma GCC diagnostic ignored "-Wuninitialized"
 #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"  // NOLINT
         uint64_t temp_ptr, sm;                          // NOLINT
-
-#if SEND_SLAB_BRANCHES == 0
-        uint64_t offset, next_reg = OBJ_SLAB_NEXT_OFFSET;
-#endif
-
 #pragma GCC diagnostic push
 #pragma GCC diagnostic push
 
-#if SEND_SLAB_BRANCHES == 0
         // clang-format off
-        asm volatile(
+        asm volatile goto(
             RSEQ_INFO_DEF(32)
             RSEQ_CS_ARR_DEF()
 
@@ -176,68 +1059,28 @@ struct object_allocator {
             "1:\n\t"
             // any register will do
             RSEQ_PREP_CS_DEF(%[temp_ptr])
-            
-            "xorq %[offset], %[offset]\n\t"
-            
-            "movl %%fs:__rseq_abi@tpoff+4, %k[sm]\n\t"
-            "salq %[LOG_SIZEOF_SM], %[sm]\n\t"
-            "addq %[sm_base], %[sm]\n\t"
-
-            "cmpq $0, (%[sm])\n\t"
-            "leaq 8(%[sm]), %[temp_ptr]\n\t"
-            
-            "cmovneq %[next_reg], %[offset]\n\t"
-            "cmovneq %[temp_ptr], %[sm]\n\t"
-            "cmovneq (%[temp_ptr]), %[temp_ptr]\n\t"
-            
-            "movq %[slab], (%[temp_ptr], %[offset])\n\t"
-            "movq %[slab], (%[sm])\n\t"
-            
-            "2:\n\t"
-
-            RSEQ_START_ABORT_DEF()
-            "jmp 1b\n\t"
-            RSEQ_END_ABORT_DEF()
-
-            : [ temp_ptr ] "=&r" (temp_ptr),
-              [ offset ] "=&r" (offset),           
-              [ sm ] "=&r" (sm),
-              [ m_clobber ] "=&m" (*(m->slab_managers))
-            : [ slab ] "r" (slab),
-              [ next_reg ] "r" (next_reg),
-              [ sm_base ] "r" (m->slab_managers[size_idx]),
-              [ LOG_SIZEOF_SM ] "i" (_log_sizeof_slab_manager)
-            : "cc");
-#elif SEND_SLAB_BRANCHES == 1
-        
-        asm volatile(
-            RSEQ_INFO_DEF(32)
-            RSEQ_CS_ARR_DEF()
 
-
-            "1:\n\t"
-            // any register will do
-            RSEQ_PREP_CS_DEF(%[temp_ptr])
-                    
-            "movl %%fs:__rseq_abi@tpoff+4, %k[sm]\n\t"
-            "salq %[LOG_SIZEOF_SM], %[sm]\n\t"
+            RSEQ_LOAD_CUR_IDX(%k[sm])
+            "salq %[LOG_CPU_STRIDE], %[sm]\n\t"
             "addq %[sm_base], %[sm]\n\t"
 
-            "cmpq $0, (%[sm])\n\t"
-            "leaq 8(%[sm]), %[temp_ptr]\n\t"
-            "je 6f\n\t"
+            // being drained (see free_cache::STOPPED)
+            "cmpq $0, 16(%[sm])\n\t"
+            "js %l[stopped]\n\t"
 
-            "movq %[temp_ptr], %[sm]\n\t"
-            "movq (%[temp_ptr]), %[temp_ptr]\n\t"
-            "addq $" V_TO_STR(OBJ_SLAB_NEXT_OFFSET) ", %[temp_ptr]\n\t"
+            // slab->next = head
+            "movq (%[sm]), %[temp_ptr]\n\t"
+            "movq %[temp_ptr], " V_TO_STR(OBJ_SLAB_NEXT_OFFSET) "(%[slab])\n\t"
 
-            "6:\n\t"
-            "movq %[slab], (%[temp_ptr])\n\t"
+            // commit head = slab
             "movq %[slab], (%[sm])\n\t"
-            
             "2:\n\t"
 
             RSEQ_START_ABORT_DEF()
+#if RSEQ_HYBRID_ABORTS
+            "cmpl %[abort_limit], %%fs:rseq_abort_count@tpoff\n\t"
+            "jae %l[aborted]\n\t"
+#endif
             "jmp 1b\n\t"
             RSEQ_END_ABORT_DEF()
 
@@ -245,186 +1088,114 @@ struct object_allocator {
               [ sm ] "=&r" (sm),
               [ m_clobber ] "=&m" (*(m->slab_managers))
             : [ slab ] "r" (slab),
-              [ sm_base ] "r" (m->slab_managers[size_idx]),
-              [ LOG_SIZEOF_SM ] "i" (_log_sizeof_slab_manager)
-            : "cc");
-#else
-        asm volatile(
-            RSEQ_INFO_DEF(32)
-            RSEQ_CS_ARR_DEF()
-
-
-            "1:\n\t"
-            // any register will do
-            RSEQ_PREP_CS_DEF(%[temp_ptr])
-
-            
-            "movl %%fs:__rseq_abi@tpoff+4, %k[sm]\n\t"
-            "salq %[LOG_SIZEOF_SM], %[sm]\n\t"
-            "addq %[sm_base], %[sm]\n\t"
-
-            "cmpq $0, (%[sm])\n\t"
-            "leaq 8(%[sm]), %[temp_ptr]\n\t"
-            
-            "jne 6f\n\t"
-            "movq %[slab], (%[temp_ptr])\n\t"
-            "jmp 7f\n\t"
-            
-            "6:\n\t"
-            "movq %[temp_ptr], %[sm]\n\t"
-            "movq (%[temp_ptr]), %[temp_ptr]\n\t"
-            "movq %[slab], " V_TO_STR(OBJ_SLAB_NEXT_OFFSET) "(%[temp_ptr])\n\t"
-            "7:\n\t"
-            "movq %[slab], (%[sm])\n\t"
-            "2:\n\t"
+              [ sm_base ] "r" (m->sm_base(size_idx)),
+              [ LOG_CPU_STRIDE ] "i" (_log_cpu_stride),
+              [ abort_limit ] "r" (abort_limit),
+              RSEQ_AREA_OPERANDS()
+            : "cc", "memory"
+            : stopped, aborted);
+        // clang-format on
+        return SEND_OK;
+    stopped:
+        return SEND_STOPPED;
+    aborted:
+        return SEND_ABORTED;
+    }
 
-            RSEQ_START_ABORT_DEF()
-            "jmp 1b\n\t"
-            RSEQ_END_ABORT_DEF()
+    // Parks slab (owned, on no list) with the calling thread, see
+    // _send_slab. 0 if the thread's hybrid_state is another allocator's:
+    // releasing that takes live.lock, which whoever holds it may be
+    // waiting on us for (a drain).
+    uint32_t
+    _park_slab(slab_t * slab) {
+        hybrid_state * h = &hybrid;
+        if (h->owner != this || h->owner_id != live_id ||
+            h->generation != m->generation) {
+            if (h->owner != NULL) {
+                return 0;
+            }
+            h->owner      = this;
+            h->owner_id   = live_id;
+            h->generation = m->generation;
+        }
+        slab->next = h->parked;
+        h->parked  = slab;
+        return 1;
+    }
 
-            : [ temp_ptr ] "=&r" (temp_ptr),
-              [ sm ] "=&r" (sm),
-              [ m_clobber ] "=&m" (*(m->slab_managers))
-            : [ slab ] "r" (slab),
-              [ sm_base ] "r" (m->slab_managers[size_idx]),
-              [ LOG_SIZEOF_SM ] "i" (_log_sizeof_slab_manager)
-            : "cc");
-        // clang-format on
-#endif
+    // sends the slabs the thread parked
+    void
+    _send_parked() {
+        hybrid_state * h = &hybrid;
+        if (BRANCH_LIKELY(h->parked == NULL) || h->owner != this ||
+            h->owner_id != live_id || h->generation != m->generation) {
+            return;
+        }
+        slab_t * slab = h->parked;
+        h->parked     = NULL;
+        while (slab != NULL) {
+            slab_t * next = slab->next;
+            slab->next    = NULL;
+            _send_slab(slab, addr_to_size_idx((void *)slab));
+            slab = next;
+        }
     }
 
 
-    uint64_t
+    // 0 if the cache is empty (or being drained)
+    uint64_t ALWAYS_INLINE
     try_pop(const uint32_t size_idx) {
-
-#pragma GCC diagnostic ignored "-Wuninitialized"
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"  // NOLINT
-        uint64_t ret, fc_cache;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic push
-        // clang-format off
-                asm volatile(
-                    RSEQ_INFO_DEF(32)
-                    RSEQ_CS_ARR_DEF()
-
-              
-                    "1:\n\t"
-                    // any register will do
-                    RSEQ_PREP_CS_DEF(%[ret])
-
-
-                    "movl %%fs:__rseq_abi@tpoff+4, %k[fc_cache]\n\t"
-                    "salq %[LOG_SIZEOF_SM], %[fc_cache]\n\t"
-                    "addq %[sm_base], %[fc_cache]\n\t"
-                
-                    "movq 16(%[fc_cache]), %[ret]\n\t"
-                    "testq %[ret], %[ret]\n\t"
-                    "jz 2f\n\t"
-
-                    "movq 16(%[fc_cache], %[ret], 8), %[ret]\n\t"
-                
-                    "subq $1, 16(%[fc_cache])\n\t"
-                    "2:\n\t"
-
-                    RSEQ_START_ABORT_DEF()
-                    "jmp 1b\n\t"
-                    RSEQ_END_ABORT_DEF()
-            
-                    : [ ret ] "=&r" (ret),
-                      [ fc_cache ] "=&r" (fc_cache),
-                      [ m_clobber ] "=&m" (*(m->slab_managers))
-                    : [ sm_base ] "r" (m->slab_managers[size_idx]),
-                      [ LOG_SIZEOF_SM ] "i" (_log_sizeof_slab_manager)
-                    : "cc");
-        // clang-format on
-        return ret;
+        return free_cache<cache_size>::template try_pop<_log_cpu_stride>(
+            &(m->sm_base(size_idx)->fc));
     }
 
-    uint64_t
+    uint64_t ALWAYS_INLINE
     try_push(uint64_t ptr, const uint32_t size_idx) {
-#pragma GCC diagnostic ignored "-Wuninitialized"
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"  // NOLINT
-        uint64_t idx, fc_cache;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic push
-        // clang-format off
-                asm volatile goto(
-                    RSEQ_INFO_DEF(32)
-                    RSEQ_CS_ARR_DEF()
-
-
-                    "1:\n\t"
-                    // any register will do
-                    RSEQ_PREP_CS_DEF(%[fc_cache])
-
-
-                    "movl %%fs:__rseq_abi@tpoff+4, %k[fc_cache]\n\t"
-                    "salq %[LOG_SIZEOF_SM], %[fc_cache]\n\t"
-                    "addq %[sm_base], %[fc_cache]\n\t"
-                
-                    "movq 16(%[fc_cache]), %[idx]\n\t"
-                    "cmpq %[CACHE_SIZE], %[idx]\n\t"
-                    "je %l[no_push]\n\t"
-
-                    "movq %[ptr], 24(%[fc_cache], %[idx], 8)\n\t"
-                    "addq $1, 16(%[fc_cache])\n\t"
-                    "2:\n\t"
-
-                    RSEQ_START_ABORT_DEF()
-                    "jmp 1b\n\t"
-                    RSEQ_END_ABORT_DEF()
-                    :
-                    :[ idx ] "r" (idx),
-                     [ fc_cache ] "r" (fc_cache),
-                     [ ptr ] "r" (ptr),
-                     [ sm_base ] "r" (m->slab_managers[size_idx]),
-                     [ LOG_SIZEOF_SM ] "i" (_log_sizeof_slab_manager),
-                     [ CACHE_SIZE ] "i" (cache_size)
-                    : "cc", "memory"
-                    : no_push);
-        // clang-format on
-        return 0;
-    no_push:
-        return 1;
+        return free_cache<cache_size>::template try_push<_log_cpu_stride>(
+            &(m->sm_base(size_idx)->fc),
+            ptr);
     }
 
 
     void *
     _allocate_inner(const uint32_t size_idx) {
+        ensure_thread();
+        _send_parked();
+#if RSEQ_HYBRID_ABORTS
+        rseq_abort_count = 0;
+#endif
         while (1) {
-            const uint64_t start_cpu = get_start_cpu();
-            IMPOSSIBLE_COND(start_cpu >= NPROCS);
+            const uint64_t start_cpu = get_start_idx();
+            IMPOSSIBLE_COND(start_cpu >= m->nprocs);
 
-            slab_manager_t * sm = m->slab_managers[size_idx] + start_cpu;
+            slab_manager_t * sm = m->get_sm(start_cpu, size_idx);
             slab_t *         _available_slabs_head = sm->available_slabs_head;
             OBJ_DBG_ASSERT(
                 (((uint64_t)_available_slabs_head) % sizeof(obj_slab)) == 0);
             OBJ_DBG_ASSERT((((uint64_t)(sm->available_slabs_head)) %
                             sizeof(obj_slab)) == 0);
-            OBJ_DBG_ASSERT((((uint64_t)(sm->available_slabs_tail)) %
-                            sizeof(obj_slab)) == 0);
 
 
             if (BRANCH_UNLIKELY(_available_slabs_head == NULL)) {
-                if (m->slab_allocator.out_of_memory(end)) {
+                slab_t * new_slab = _new_slab(size_idx);
+                if (new_slab == NULL) {
                     return NULL;
                 }
-
-                slab_t * new_slab = m->slab_allocator._new();
                 OBJ_DBG_ASSERT((((uint64_t)new_slab) % sizeof(obj_slab)) == 0);
-
-                if ((new_slab) >= ((slab_t *)end)) {
-                    return NULL;
-                }
                 new ((void * const)new_slab) slab_t(idx_to_size(size_idx));
 
                 OBJ_DBG_ASSERT(new_slab != NULL);
                 OBJ_DBG_ASSERT(new_slab->next == NULL);
-                _send_slab(new_slab, size_idx);
+                // parked, the cpu's list would just be missed again
+                if (BRANCH_UNLIKELY(_send_slab(new_slab, size_idx))) {
+                    return _allocate_private(size_idx, _cur_node());
+                }
             }
             else {
 
-                uint64_t ret = _available_slabs_head->_allocate(start_cpu);
+                uint64_t ret = _available_slabs_head->_allocate(
+                    start_cpu,
+                    &(sm->available_slabs_head));
                 if (BRANCH_LIKELY(ret < slab_t::SUCCESS_BOUND)) {
                     return (void *)(_available_slabs_head->payload +
                                     idx_to_size(size_idx) * ret);
@@ -446,10 +1217,559 @@ struct object_allocator {
                         }
                     }
                 }
-            }
+#if RSEQ_HYBRID_ABORTS
+                else if (BRANCH_UNLIKELY(rseq_abort_count >=
+                                         RSEQ_HYBRID_ABORTS)) {
+                    return _allocate_private(size_idx, _cur_node());
+                }
+#endif
+                else if (BRANCH_UNLIKELY(sm->fc.current_idx & fc_stopped)) {
+                    _wait_stopped();
+                }
+            }
+        }
+    }
+
+    // manager whose chunk slabs for size_idx are carved from (and filler
+    // set free slabs for it come from): a cpu shares one chunk between
+    // classes unless classes have their own address range
+    static constexpr uint32_t
+    chunk_idx(const uint32_t size_idx) {
+        return slab_allocator_t::partitioned ? size_idx : 0;
+    }
+
+    // numa node the calling thread is on (as far as slab_allocator's
+    // nodes go)
+    uint32_t ALWAYS_INLINE
+    _cur_node() const {
+#if SLAB_NUMA_NODES > 1
+        return get_cur_node() % m->slab_allocator.nnodes;
+#else
+        return 0;
+#endif
+    }
+
+    static constexpr uint32_t
+    filler_set(const uint32_t node, const uint32_t size_idx) {
+        return node * filler_class_sets + chunk_idx(size_idx);
+    }
+
+    // Bytes of the region in use: the metadata and every slab (or chunk)
+    // handed out so far less what the filler gave back to the os. What the
+    // limits are checked against.
+    uint64_t
+    memory_usage() const {
+        uint64_t usage = get_meta_region_size();
+        m->slab_allocator.for_each_used([&](uint64_t lo, uint64_t bytes) {
+            (void)(lo);
+            usage += bytes;
+        });
+        const uint64_t released =
+            __atomic_load_n(&(m->filler.nreleased), __ATOMIC_RELAXED) *
+                filler_t::hp_size +
+            __atomic_load_n(&(m->filler.ndropped_bytes), __ATOMIC_RELAXED);
+        return usage > released ? usage - released : 0;
+    }
+
+    // Limits on memory_usage(), checked only when new memory is taken from
+    // the region (once per chunk a cpu refills, see _new_slab) so a cpu's
+    // chunk is memory it already accounted for and the fast path never
+    // looks at them.
+    // soft_limit -> going over it reclaims (see reclaim), again every
+    //               soft_limit / 16 bytes of growth
+    // hard_limit -> new memory that would go over it is refused, the
+    //               allocation is out of memory as if the region was used
+    //               up (see _out_of_memory). Reusing free slabs is never
+    //               refused.
+    // no_limit for either to disable it
+    void
+    set_memory_limits(const uint64_t soft, const uint64_t hard) {
+        DIE_ASSERT(soft <= hard,
+                   "Error soft limit %lu above hard limit %lu\n",
+                   soft,
+                   hard);
+        __atomic_store_n(&reclaim_next, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&oom_reclaim_next, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&soft_limit, soft, __ATOMIC_RELAXED);
+        __atomic_store_n(&hard_limit, hard, __ATOMIC_RELAXED);
+    }
+
+    // see oom_handler_t. Meant to be set once during startup (handler and
+    // arg are not set together atomically).
+    void
+    set_oom_handler(oom_handler_t handler, void * arg) {
+        oom_arg     = arg;
+        oom_handler = handler;
+    }
+
+    // Drains every cpu's caches (see drain_cpu), so empty slabs go to the
+    // filler and huge pages that end up all free go back to the os. Cpus
+    // with nothing cached are skipped so calling it again and again (e.g
+    // from every allocation while out of memory) stays cheap. Where
+    // others' caches can't be drained safely only the calling thread's
+    // index is (rseq_fallback) or nothing is, likewise for a multi process
+    // heap unless the caller is a maintenance thread (see _stop_cpu).
+    // Skipped if other maintenance is running. Returns number of objects
+    // and slabs moved.
+    uint64_t
+    reclaim() {
+        if (!rseq_fence_supported() && !rseq_fallback) {
+            return 0;
+        }
+        if (_trylock_maintenance()) {
+            return 0;
+        }
+        uint64_t ndrained = 0;
+        if (rseq_fence_supported()) {
+            for (uint32_t i = 0; i < m->nprocs; ++i) {
+                if (idx_reachable(&m->reachable, m->nreachable, i) &&
+                    cpu_activity(i) != 0) {
+                    ndrained += _drain_cpu(i);
+                }
+            }
+        }
+        else {
+            ensure_thread();
+            ndrained = _drain_cpu(get_cur_cpu());
+        }
+        _unlock_maintenance();
+        return ndrained;
+    }
+
+    // Gives the pages of every free slab back to the os, not just whole
+    // huge pages of them (see hugepage_filler::release_free). Only worth
+    // it under memory pressure, after reclaim(). Returns bytes released.
+    uint64_t
+    release_free_memory() {
+        return m->filler.release_free();
+    }
+
+    // whether bytes of new memory can be taken (GROW), or after reclaiming
+    // free slabs should be looked for again first (RETRY), or not (DENY,
+    // the allocation's _out_of_memory reclaims and asks the handler).
+    // attempt is how many times the caller asked for this allocation.
+    uint32_t
+    _limit_check(const uint64_t bytes, const uint32_t attempt) {
+        // soft <= hard so this is no limits at all
+        const uint64_t soft = __atomic_load_n(&soft_limit, __ATOMIC_RELAXED);
+        if (BRANCH_LIKELY(soft == no_limit)) {
+            return GROW;
+        }
+        const uint64_t hard = __atomic_load_n(&hard_limit, __ATOMIC_RELAXED);
+
+        const uint64_t usage = memory_usage();
+        if (usage + bytes <= soft) {
+            return GROW;
+        }
+        if (usage + bytes > hard) {
+            return DENY;
+        }
+        if (attempt == 0 &&
+            usage >= __atomic_load_n(&reclaim_next, __ATOMIC_RELAXED)) {
+            reclaim();
+            __atomic_store_n(&reclaim_next,
+                             memory_usage() + bytes + soft / 16,
+                             __ATOMIC_RELAXED);
+            return RETRY;
+        }
+        return GROW;
+    }
+
+    // 1 if bytes of new memory can be taken for size_idx. Otherwise 0 and
+    // *slab_out is a free slab found instead (NULL if the hard limit
+    // holds).
+    uint32_t
+    _may_grow(const uint32_t size_idx,
+              const uint32_t node,
+              const uint64_t bytes,
+              slab_t **      slab_out) {
+        for (uint32_t attempt = 0;; ++attempt) {
+            const uint32_t limit = _limit_check(bytes, attempt);
+            if (BRANCH_LIKELY(limit == GROW)) {
+                return 1;
+            }
+            slab_t * slab = _reuse_slab(size_idx, node);
+            if (slab == NULL) {
+                slab = _reuse_remote_slab(size_idx, node);
+            }
+            if (slab != NULL || limit == DENY) {
+                *slab_out = slab;
+                return 0;
+            }
+        }
+    }
+
+    // Next slab for size_idx on the current cpu, NULL if out of memory.
+    // Each cpu carves slabs from its own chunk (see chunk_idx) and only goes
+    // to the shared slab_allocator for a new chunk, so the shared cursor is
+    // hit once per chunk_slabs slabs and a cpu's slabs are contiguous.
+    // Free and new slabs come from the thread's node, other nodes' only
+    // once it has none left. A chunk is from the node of the thread that
+    // refilled it.
+    slab_t *
+    _new_slab(const uint32_t size_idx) {
+        const uint32_t node = _cur_node();
+        slab_t *       slab = _reuse_slab(size_idx, node);
+        if (slab != NULL) {
+            return slab;
+        }
+
+        uint64_t nslabs;
+#if SLAB_CHUNK_SIZE
+        // aborts carving / installing a chunk are bounded as allocating is
+        // (see _allocate_inner), past that (or while the cpu is being
+        // drained) the slab skips the cpu's chunk
+        const uint32_t abort_limit = rseq_abort_count + RSEQ_HYBRID_ABORTS;
+        while (1) {
+            slab = _try_carve_slab(chunk_idx(size_idx), abort_limit);
+            if (BRANCH_LIKELY(((uint64_t)slab) > carve_skipped)) {
+                return slab;
+            }
+            if (BRANCH_UNLIKELY(((uint64_t)slab) == carve_skipped)) {
+                return _new_slab_on(size_idx, node);
+            }
+            // a new chunk is what the limits are checked on
+            if (!_may_grow(size_idx,
+                           node,
+                           chunk_slabs * sizeof(slab_t),
+                           &slab)) {
+                return slab;
+            }
+
+            slab_t * chunk = m->slab_allocator._new_chunk(node,
+                                                          size_idx,
+                                                          chunk_slabs,
+                                                          &nslabs);
+            if (chunk == NULL) {
+                return _reuse_remote_slab(size_idx, node);
+            }
+
+            // another thread on this cpu got there first, use theirs
+            if (_try_set_chunk(chunk_idx(size_idx),
+                               ((uint64_t)chunk) |
+                                   (nslabs << chunk_left_shift),
+                               abort_limit)) {
+                _return_slabs(size_idx, chunk, nslabs, chunk_slabs);
+                if (RSEQ_HYBRID_ABORTS && rseq_abort_count >= abort_limit) {
+                    return _new_slab_on(size_idx, node);
+                }
+            }
+        }
+#else
+        if (!_may_grow(size_idx, node, sizeof(slab_t), &slab)) {
+            return slab;
+        }
+        slab = m->slab_allocator._new_chunk(node, size_idx, 1, &nslabs);
+        return slab != NULL ? slab : _reuse_remote_slab(size_idx, node);
+#endif
+    }
+
+    // a free slab on node from the filler, NULL if none
+    slab_t *
+    _reuse_slab(const uint32_t size_idx, const uint32_t node) {
+        return m->filler.take(filler_set(node, size_idx));
+    }
+
+    // a free slab on any node but node, NULL if none
+    slab_t *
+    _reuse_remote_slab(const uint32_t size_idx, const uint32_t node) {
+        for (uint32_t i = 1; i < m->slab_allocator.nnodes; ++i) {
+            slab_t * slab = _reuse_slab(size_idx,
+                                        (node + i) % m->slab_allocator.nnodes);
+            if (slab != NULL) {
+                return slab;
+            }
+        }
+        return NULL;
+    }
+
+    // a slab for size_idx on node without going through any cpu's chunk
+    // (free ones first), NULL if out of memory
+    slab_t *
+    _new_slab_on(const uint32_t size_idx, const uint32_t node) {
+        uint64_t nslabs;
+        slab_t * slab = _reuse_slab(size_idx, node);
+        if (slab != NULL ||
+            !_may_grow(size_idx, node, sizeof(slab_t), &slab)) {
+            return slab;
+        }
+        slab = m->slab_allocator._new_chunk(node, size_idx, 1, &nslabs);
+        return slab != NULL ? slab : _reuse_remote_slab(size_idx, node);
+    }
+
+    // nslabs contiguous new slabs from the thread's node (other nodes' once
+    // it has none left) to use as plain memory outside the heap, e.g
+    // io_buffer_pool's buffers. They are on no list so nothing but the
+    // caller touches them, and count towards the limits. NULL if no range
+    // that long is left (or the hard limit holds). Give them back with
+    // put_raw_slabs, reset() takes them back regardless. *generation is
+    // the heap's generation they were taken in.
+    slab_t *
+    take_raw_slabs(const uint64_t nslabs, uint64_t * generation) {
+        *generation = m->generation;
+        uint32_t limit;
+        for (uint32_t attempt = 0;
+             (limit = _limit_check(nslabs * sizeof(slab_t), attempt)) ==
+             RETRY;
+             ++attempt) {
+        }
+        if (limit == DENY) {
+            return NULL;
+        }
+
+        uint64_t nslabs_out;
+        slab_t * slabs =
+            m->slab_allocator._new_chunk(_cur_node(), 0, nslabs, &nslabs_out);
+        // the end of a range, not worth stitching to the next (to the
+        // filler if another chunk was taken after it)
+        if (slabs != NULL && nslabs_out != nslabs) {
+            _return_slabs(0, slabs, nslabs_out, nslabs);
+            return NULL;
+        }
+        return slabs;
+    }
+
+    // slabs from take_raw_slabs go to the filler like slabs a drain found
+    // empty. Ignored if taken before a reset() (generation is an older
+    // one): the heap has them back already and may have handed them out
+    // again.
+    void
+    put_raw_slabs(slab_t *       slabs,
+                  const uint64_t nslabs,
+                  const uint64_t generation) {
+        if (generation == m->generation) {
+            _put_free_slabs(slabs, nslabs, 0);
+        }
+    }
+
+    // unused slabs (on no list) for size_idx to the filler
+    void
+    _put_free_slabs(slab_t *       slabs,
+                    const uint64_t nslabs,
+                    const uint32_t size_idx) {
+        for (uint64_t i = 0; i < nslabs; ++i) {
+            const uint32_t node =
+                m->slab_allocator.addr_to_node((uint64_t)(slabs + i));
+            m->filler.put(slabs + i, filler_set(node, size_idx));
+        }
+    }
+
+    // Gives back the unused end of a chunk: nslabs slabs at slabs, where
+    // _new_chunk left the cursor nslabs_asked slabs past slabs (more than
+    // nslabs if the chunk was cut short at the end of the range). Back to
+    // the slab_allocator if nothing was taken after it, otherwise to the
+    // filler.
+    void
+    _return_slabs(const uint32_t size_idx,
+                  slab_t *       slabs,
+                  const uint64_t nslabs,
+                  const uint64_t nslabs_asked) {
+        if (!m->slab_allocator._return_chunk(size_idx, slabs, nslabs_asked)) {
+            _put_free_slabs(slabs, nslabs, size_idx);
+        }
+    }
+
+    // _try_carve_slab gave up after too many aborts or found the cpu being
+    // drained
+    static constexpr uint64_t carve_skipped = 1;
+
+    // NULL if the current cpu's chunk is used up, carve_skipped once
+    // rseq_abort_count reaches abort_limit or if the cpu is STOPPED (its
+    // chunk may be being taken, see _drain_cpu)
+    slab_t *
+    _try_carve_slab(const uint32_t chunk_idx, const uint32_t abort_limit) {
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"  // NOLINT
+        uint64_t ret, next, sm;                         // NOLINT
+#pragma GCC diagnostic push
+#pragma GCC diagnostic push
+
+        // clang-format off
+        asm volatile(
+            RSEQ_INFO_DEF(32)
+            RSEQ_CS_ARR_DEF()
+
+
+            "1:\n\t"
+            // any register will do
+            RSEQ_PREP_CS_DEF(%[ret])
+
+            RSEQ_LOAD_CUR_IDX(%k[sm])
+            "salq %[LOG_CPU_STRIDE], %[sm]\n\t"
+            "addq %[sm_base], %[sm]\n\t"
+
+            // being drained (see free_cache::STOPPED)
+            "cmpq $0, 16(%[sm])\n\t"
+            "js 6f\n\t"
+
+            // none left
+            "movq 8(%[sm]), %[ret]\n\t"
+            "cmpq %[ONE_LEFT], %[ret]\n\t"
+            "jb 5f\n\t"
+
+            "leaq %c[SLAB_SIZE](%[ret]), %[next]\n\t"
+            "subq %[ONE_LEFT], %[next]\n\t"
+
+            // commit
+            "movq %[next], 8(%[sm])\n\t"
+            "2:\n\t"
+
+            // clear count
+            "shlq %[COUNT_BITS], %[ret]\n\t"
+            "shrq %[COUNT_BITS], %[ret]\n\t"
+
+            RSEQ_START_ABORT_DEF()
+#if RSEQ_HYBRID_ABORTS
+            "cmpl %[abort_limit], %%fs:rseq_abort_count@tpoff\n\t"
+            "jae 6f\n\t"
+#endif
+            "jmp 1b\n\t"
+            "5:\n\t"
+            "xorl %k[ret], %k[ret]\n\t"
+            "jmp 2b\n\t"
+            "6:\n\t"
+            "movl %[SKIPPED], %k[ret]\n\t"
+            "jmp 2b\n\t"
+            RSEQ_END_ABORT_DEF()
+
+            : [ ret ] "=&r" (ret),
+              [ next ] "=&r" (next),
+              [ sm ] "=&r" (sm)
+            : [ sm_base ] "r" (m->sm_base(chunk_idx)),
+              [ ONE_LEFT ] "r" (chunk_one_left),
+              [ SKIPPED ] "i" (carve_skipped),
+              [ abort_limit ] "r" (abort_limit),
+              [ SLAB_SIZE ] "i" (sizeof(slab_t)),
+              [ COUNT_BITS ] "i" (64 - chunk_left_shift),
+              [ LOG_CPU_STRIDE ] "i" (_log_cpu_stride),
+              RSEQ_AREA_OPERANDS()
+            : "cc", "memory");
+        // clang-format on
+        return (slab_t *)ret;
+    }
+
+    // installs chunk as the current cpu's unless it still has one (or
+    // rseq_abort_count reaches abort_limit, or the cpu is STOPPED). Returns
+    // 1 if not installed.
+    uint32_t
+    _try_set_chunk(const uint32_t chunk_idx,
+                   const uint64_t chunk,
+                   const uint32_t abort_limit) {
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"  // NOLINT
+        uint64_t sm;                                    // NOLINT
+#pragma GCC diagnostic push
+#pragma GCC diagnostic push
+
+        // clang-format off
+        asm volatile goto(
+            RSEQ_INFO_DEF(32)
+            RSEQ_CS_ARR_DEF()
+
+
+            "1:\n\t"
+            // any register will do
+            RSEQ_PREP_CS_DEF(%[sm])
+
+            RSEQ_LOAD_CUR_IDX(%k[sm])
+            "salq %[LOG_CPU_STRIDE], %[sm]\n\t"
+            "addq %[sm_base], %[sm]\n\t"
+
+            // being drained (see free_cache::STOPPED)
+            "cmpq $0, 16(%[sm])\n\t"
+            "js %l[has_chunk]\n\t"
+
+            "cmpq %[ONE_LEFT], 8(%[sm])\n\t"
+            "jae %l[has_chunk]\n\t"
+
+            // commit
+            "movq %[chunk], 8(%[sm])\n\t"
+            "2:\n\t"
+
+            RSEQ_START_ABORT_DEF()
+#if RSEQ_HYBRID_ABORTS
+            "cmpl %[abort_limit], %%fs:rseq_abort_count@tpoff\n\t"
+            "jae %l[has_chunk]\n\t"
+#endif
+            "jmp 1b\n\t"
+            RSEQ_END_ABORT_DEF()
+
+            : [ sm ] "=&r" (sm)
+            : [ chunk ] "r" (chunk),
+              [ sm_base ] "r" (m->sm_base(chunk_idx)),
+              [ ONE_LEFT ] "r" (chunk_one_left),
+              [ abort_limit ] "r" (abort_limit),
+              [ LOG_CPU_STRIDE ] "i" (_log_cpu_stride),
+              RSEQ_AREA_OPERANDS()
+            : "cc", "memory"
+            : has_chunk);
+        // clang-format on
+        return 0;
+    has_chunk:
+        return 1;
+    }
+
+    // Taken after an allocation has aborted RSEQ_HYBRID_ABORTS times (i.e
+    // the machine is overcommitted and the thread keeps being preempted in
+    // the critical section) and for allocations hinted to a remote node.
+    // Allocates from a slab on node private to the thread so no rseq is
+    // needed; objects freed into it by others are reclaimed with the
+    // atomic exchange in _try_release. Bounded regardless of preemption.
+    void *
+    _allocate_private(const uint32_t size_idx, const uint32_t node) {
+        hybrid_state * h = &hybrid;
+        if (h->owner != this || h->owner_id != live_id ||
+            h->generation != m->generation) {
+            h->release();
+            h->owner      = this;
+            h->owner_id   = live_id;
+            h->generation = m->generation;
+        }
+
+        slab_t * slab = h->slabs[node][size_idx];
+        while (1) {
+            if (slab == NULL) {
+                slab = _new_slab_on(size_idx, node);
+                if (slab == NULL) {
+                    return NULL;
+                }
+                new ((void * const)slab) slab_t(idx_to_size(size_idx));
+                h->slabs[node][size_idx] = slab;
+            }
+
+            const uint64_t ret = slab->_allocate_private();
+            if (BRANCH_LIKELY(ret < slab_t::SUCCESS_BOUND)) {
+                return (void *)(slab->payload + idx_to_size(size_idx) * ret);
+            }
+
+            // nothing freed: slab is now unowned and will be claimed by
+            // whoever frees into it first
+            if (slab->_try_release()) {
+                slab                     = NULL;
+                h->slabs[node][size_idx] = NULL;
+            }
         }
     }
 
+    static constexpr uint32_t any_node = (~(0U));
+
+    // node is a hint: the object comes from a slab on node (see
+    // _allocate_private) unless that is the thread's own node anyway
+    void *
+    _allocate(const uint32_t size, const uint32_t node) {
+#if SLAB_NUMA_NODES > 1
+        const uint32_t _node = node % m->slab_allocator.nnodes;
+        if (_node != _cur_node()) {
+            void * ret = _allocate_private(size_to_idx(size), _node);
+            return BRANCH_LIKELY(ret != NULL) ? ret
+                                              : _out_of_memory(size, _node);
+        }
+#else
+        (void)(node);
+#endif
+        return _allocate(size);
+    }
+
     void *
     _allocate(const uint32_t size) {
         const uint32_t size_idx = size_to_idx(size);
@@ -457,7 +1777,76 @@ struct object_allocator {
         if (ptr > ((1UL) << _log_sizeof_slab_manager)) {
             return (void *)ptr;
         }
-        return _allocate_inner(size_idx);
+        if (BRANCH_UNLIKELY(rseq_fallback_no_idx_held())) {
+            return _allocate_no_idx(size);
+        }
+        void * ret = _allocate_inner(size_idx);
+        return BRANCH_LIKELY(ret != NULL) ? ret
+                                          : _out_of_memory(size, any_node);
+    }
+
+    // rseq_fallback and the thread has no index (see _stop_no_idx): one
+    // it has yet to register for, otherwise the shared one
+    void * NEVER_INLINE
+    _allocate_no_idx(const uint32_t size) {
+        ensure_thread();
+        if (!rseq_fallback_no_idx_held()) {
+            return _allocate(size);
+        }
+        void * ret;
+        rseq_fallback_run_shared([&]() { ret = _allocate(size); });
+        return ret;
+    }
+
+    // An allocation found no memory: reclaims (what drains free may land
+    // on this cpu or in the filler, rate limited by SLAB_OOM_RECLAIM_US,
+    // see _oom_reclaim) and retries, then asks the oom handler
+    // and retries for as long as it says to. Then NULL, or malloc with
+    // SLAB_SYSTEM_FALLBACK. node as given to _allocate, any_node if none.
+    void * NEVER_INLINE COLD_ATTR
+    _out_of_memory(const uint32_t size, const uint32_t node) {
+        const uint32_t size_idx = size_to_idx(size);
+        for (uint32_t attempt = 0;; ++attempt) {
+            if (attempt == 0) {
+                _oom_reclaim();
+            }
+            else if (oom_handler == NULL ||
+                     !oom_handler(oom_arg, memory_usage(), size)) {
+                break;
+            }
+
+            void * ret = node == any_node ? _allocate_inner(size_idx)
+                                          : _allocate_private(size_idx, node);
+            if (ret != NULL) {
+                return ret;
+            }
+        }
+#if SLAB_SYSTEM_FALLBACK
+        void * ret = malloc(size);
+        if (ret != NULL) {
+            __atomic_fetch_add(&nsystem_allocs, 1, __ATOMIC_RELAXED);
+        }
+        return ret;
+#else
+        return NULL;
+#endif
+    }
+
+    // reclaim() unless another allocation out of memory did less than
+    // SLAB_OOM_RECLAIM_US ago. Of threads getting here at once one does.
+    void
+    _oom_reclaim() {
+        const uint64_t now = timers::get_ns();
+        uint64_t next = __atomic_load_n(&oom_reclaim_next, __ATOMIC_RELAXED);
+        if (now >= next &&
+            __atomic_compare_exchange_n(&oom_reclaim_next,
+                                        &next,
+                                        now + SLAB_OOM_RECLAIM_US * 1000,
+                                        false,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            reclaim();
+        }
     }
 
     slab_t *
@@ -466,43 +1855,535 @@ struct object_allocator {
     }
 
 
+    // from the address alone if the slab_allocator_t is partitioned,
+    // otherwise has to read the slab
+    uint32_t ALWAYS_INLINE
+    addr_to_size_idx(void * addr) {
+        if constexpr (slab_allocator_t::partitioned) {
+            return slab_allocator_t::addr_to_size_idx((uint64_t)addr);
+        }
+        else {
+            return size_to_idx(addr_to_slab(addr)->block_size);
+        }
+    }
+
+    // bytes usable at addr (an allocated object)
+    uint32_t
+    usable_size(void * addr) {
+#if SLAB_SYSTEM_FALLBACK
+        if (BRANCH_UNLIKELY(!in_range(addr))) {
+            return malloc_usable_size(addr);
+        }
+#endif
+        return idx_to_size(addr_to_size_idx(addr));
+    }
+
+    // With a partitioned slab_allocator_t the slab is only touched if the
+    // free cache is full
     void
     _free(void * addr) {
-        slab_t *       slab     = addr_to_slab(addr);
-        const uint32_t size     = slab->block_size;
-        const uint32_t size_idx = size_to_idx(size);
+#if SLAB_SYSTEM_FALLBACK
+        if (BRANCH_UNLIKELY(!in_range(addr))) {
+            free(addr);
+            return;
+        }
+#endif
+        const uint32_t size_idx = addr_to_size_idx(addr);
 
         if (!try_push((uint64_t)addr, size_idx)) {
             return;
         }
+        if (BRANCH_UNLIKELY(rseq_fallback_no_idx_held())) {
+            _free_no_idx(addr);
+            return;
+        }
+        _free_to_slab(addr_to_slab(addr), addr);
+    }
 
+    // see _allocate_no_idx
+    void NEVER_INLINE
+    _free_no_idx(void * addr) {
+        ensure_thread();
+        if (!rseq_fallback_no_idx_held()) {
+            _free(addr);
+            return;
+        }
+        rseq_fallback_run_shared([&]() { _free(addr); });
+    }
+
+    // bypasses the free cache
+    void
+    _free_to_slab(slab_t * slab, void * addr) {
         OBJ_DBG_ASSERT((((uint64_t)slab) % sizeof(obj_slab)) == 0);
 
         if (slab->_free(((uint64_t)addr) - ((uint64_t)slab))) {
             if (slab->_set_owned()) {
                 OBJ_DBG_ASSERT(slab->state == slab_t::OWNED);
                 slab->next = NULL;
-                _send_slab(slab, size_idx);
+                // the class is read again now that the slab is ours: if
+                // this thread stalled after its free made the slab empty,
+                // the slab may have been reused (by the filler) for
+                // another class since
+                _send_slab(slab, addr_to_size_idx((void *)slab));
             }
         }
     }
 
+    // cpu's free_cache of each size class, for free_cache::stop
+    auto
+    _cpu_caches(const uint32_t cpu) {
+        return [this, cpu](const uint32_t size_idx) {
+            return &(m->get_sm(cpu, size_idx)->fc);
+        };
+    }
+
+    void
+    _set_stopped(const uint32_t cpu) {
+        free_cache<cache_size>::set_stopped(num_size_classes,
+                                            _cpu_caches(cpu));
+    }
+
+    // Sets STOPPED on all of cpu's caches and, if rseq_fence_supported(),
+    // waits until no critical section that missed it can still be running
+    // there. With a multi process heap membarrier doesn't reach the other
+    // processes' threads so STOPPED is set from cpu itself (see
+    // rseq_on_cpu), returns 0 (nothing set) if this thread can't run
+    // there. Only maintenance threads (rseq_may_migrate) go to another
+    // cpu for it, an application thread only stops the one it is on.
+    uint32_t
+    _stop_cpu(const uint32_t cpu) {
+        if (multi_process) {
+            return rseq_on_cpu(cpu, [&]() { _set_stopped(cpu); });
+        }
+        free_cache<cache_size>::stop(cpu, num_size_classes, _cpu_caches(cpu));
+        return 1;
+    }
+
+    // Returns everything cached by cpu (or mm_cid) to the rest of the heap:
+    // free cache entries go back to their slabs and available slabs are
+    // handed to the calling thread's cpu. With rseq_fence_supported() this
+    // is safe while other threads keep allocating on cpu (see _stop_cpu),
+    // otherwise only once no thread can run there. Returns number of
+    // objects and slabs moved (0 for a cpu of a multi process heap this
+    // thread can't run on, or isn't on if not rseq_may_migrate).
+    uint64_t
+    drain_cpu(const uint32_t cpu) {
+        _lock_maintenance();
+        const uint64_t ndrained = _drain_cpu(cpu);
+        _unlock_maintenance();
+        return ndrained;
+    }
+
+    // with maintenance_lock held
+    uint64_t
+    _drain_cpu(const uint32_t cpu) {
+        OBJ_DBG_ASSERT(cpu < m->nprocs);
+        if (_is_no_idx(cpu) || !_stop_cpu(cpu)) {
+            return 0;
+        }
+
+        // available slabs on another node than the calling thread's, by
+        // size class
+        slab_t * remote[num_size_classes];
+
+        uint64_t ndrained = 0;
+        for (uint32_t size_idx = 0; size_idx < num_size_classes; ++size_idx) {
+            slab_manager_t * sm = m->get_sm(cpu, size_idx);
+
+            uint64_t       cached[cache_size];
+            const uint64_t ncached = sm->fc.current_idx & (~fc_stopped);
+            OBJ_DBG_ASSERT(ncached <= cache_size);
+            memcpy(cached, sm->fc.ptrs, ncached * sizeof(uint64_t));
+
+            slab_t * slab = sm->available_slabs_head;
+
+            // no one can allocate from the detached slabs so the empty ones
+            // can go to the filler (and possibly back to the os). The rest
+            // move to this thread's cpu, or to a cpu on their own node if
+            // that is another one (see _send_remote_slabs)
+            const uint32_t node = _cur_node();
+            slab_t *       move = NULL;
+            remote[size_idx]    = NULL;
+            while (slab) {
+                slab_t * next = slab->next;
+                if (slab->_is_empty()) {
+                    m->filler.put(
+                        slab,
+                        filler_set(
+                            m->slab_allocator.addr_to_node((uint64_t)slab),
+                            size_idx));
+                    ++ndrained;
+                }
+                else if (rseq_idx_is_cpu() &&
+                         m->slab_allocator.addr_to_node((uint64_t)slab) !=
+                             node) {
+                    slab->next       = remote[size_idx];
+                    remote[size_idx] = slab;
+                }
+                else {
+                    slab->next = move;
+                    move       = slab;
+                    ++ndrained;
+                }
+                slab = next;
+            }
+            sm->available_slabs_head = NULL;
+
+#if SLAB_CHUNK_SIZE
+            // what's left of the chunk would otherwise stay with cpu until
+            // something allocates there again
+            if (chunk_idx(size_idx) == size_idx &&
+                sm->chunk >= chunk_one_left) {
+                const uint64_t left = sm->chunk >> chunk_left_shift;
+                _return_slabs(size_idx,
+                              (slab_t *)(sm->chunk & (chunk_one_left - 1)),
+                              left,
+                              left);
+                sm->chunk = 0;
+                ndrained += left;
+            }
+#endif
+
+            // empty, cpu can use it again (and _send_slab below may target
+            // it)
+            __atomic_store_n(&(sm->fc.current_idx), 0, __ATOMIC_RELEASE);
+
+            for (uint32_t i = 0; i < ncached; ++i) {
+                void * addr = (void *)cached[i];
+                _free_to_slab(addr_to_slab(addr), addr);
+            }
+            ndrained += ncached;
+
+            while (move) {
+                slab_t * next = move->next;
+                move->next    = NULL;
+                _send_slab(move, size_idx);
+                move = next;
+            }
+        }
+        return ndrained + _send_remote_slabs(cpu, remote);
+    }
+
+    // Hands each slab in remote (by size class) to a reachable cpu on its
+    // node other than drained, pushed on that cpu's list while it is
+    // stopped. Slabs of a node with no such cpu (or one this thread can't
+    // stop) go to the calling thread's cpu instead. With maintenance_lock
+    // held. Returns number of slabs moved.
+    uint64_t
+    _send_remote_slabs(const uint32_t drained, slab_t ** remote) {
+        uint64_t nsent    = 0;
+        uint32_t size_idx = 0;
+        while (1) {
+            // node of the next slab left
+            for (; size_idx < num_size_classes && remote[size_idx] == NULL;
+                 ++size_idx) {
+            }
+            if (size_idx == num_size_classes) {
+                return nsent;
+            }
+            const uint32_t node =
+                m->slab_allocator.addr_to_node((uint64_t)remote[size_idx]);
+
+            uint32_t target = _node_cpu(node, drained);
+            if (target < m->nprocs && !_stop_cpu(target)) {
+                target = m->nprocs;
+            }
+            for (uint32_t i = size_idx; i < num_size_classes; ++i) {
+                slab_manager_t * sm =
+                    target < m->nprocs ? m->get_sm(target, i) : NULL;
+                slab_t ** prev = remote + i;
+                while (*prev != NULL) {
+                    slab_t * slab = *prev;
+                    if (m->slab_allocator.addr_to_node((uint64_t)slab) !=
+                        node) {
+                        prev = &(slab->next);
+                        continue;
+                    }
+                    *prev = slab->next;
+                    ++nsent;
+                    if (target < m->nprocs) {
+                        slab->next               = sm->available_slabs_head;
+                        sm->available_slabs_head = slab;
+                    }
+                    else {
+                        slab->next = NULL;
+                        _send_slab(slab, i);
+                    }
+                }
+            }
+            if (target < m->nprocs) {
+                _unstop_cpu(target);
+            }
+        }
+    }
+
+    // a reachable cpu on node other than skip, m->nprocs if none
+    uint32_t
+    _node_cpu(const uint32_t node, const uint32_t skip) {
+        for (uint32_t i = 0; i < m->nprocs; ++i) {
+            if (i != skip && !_is_no_idx(i) &&
+                idx_reachable(&m->reachable, m->nreachable, i) &&
+                sysi::cpu_to_node(i) % m->slab_allocator.nnodes == node) {
+                return i;
+            }
+        }
+        return m->nprocs;
+    }
+
+    // undoes _stop_cpu, leaving what cpu has cached in place
+    void
+    _unstop_cpu(const uint32_t cpu) {
+        for (uint32_t size_idx = 0; size_idx < num_size_classes; ++size_idx) {
+            uint64_t * idx = &(m->get_sm(cpu, size_idx)->fc.current_idx);
+            __atomic_store_n(idx,
+                             __atomic_load_n(idx, __ATOMIC_RELAXED) &
+                                 (~fc_stopped),
+                             __ATOMIC_RELEASE);
+        }
+    }
+
+    // Tops up cpu's caches for every size class in size_class_mask (bit i
+    // -> class i) so that nobjs objects can be allocated there without
+    // leaving the fast path or faulting: free cache entries first, then
+    // slabs on the cpu's list (new ones from cpu's node, populated). Same
+    // rules as drain_cpu for when it's safe, so during startup it's fine
+    // either way. Returns number of objects added (less than asked if out
+    // of memory).
+    uint64_t
+    prewarm_cpu(const uint32_t cpu,
+                const uint64_t size_class_mask,
+                const uint64_t nobjs) {
+        _lock_maintenance();
+        const uint64_t nadded = _prewarm_cpu(cpu, size_class_mask, nobjs);
+        _unlock_maintenance();
+        return nadded;
+    }
+
+    // prewarm_cpu for every cpu this process can run on (every mm_cid it
+    // may use). With rseq_fallback indexes are per thread and mostly never
+    // used, only the calling thread's is done.
+    uint64_t
+    prewarm(const uint64_t size_class_mask, const uint64_t nobjs_per_cpu) {
+        if (rseq_fallback) {
+            ensure_thread();
+            return prewarm_cpu(get_cur_cpu(), size_class_mask, nobjs_per_cpu);
+        }
+
+        _lock_maintenance();
+        uint64_t nadded = 0;
+        for (uint32_t i = 0; i < m->nprocs; ++i) {
+            if (idx_reachable(&m->reachable, m->nreachable, i)) {
+                nadded += _prewarm_cpu(i, size_class_mask, nobjs_per_cpu);
+            }
+        }
+        _unlock_maintenance();
+        return nadded;
+    }
+
+    // with maintenance_lock held
+    uint64_t
+    _prewarm_cpu(const uint32_t cpu,
+                 const uint64_t size_class_mask,
+                 const uint64_t nobjs) {
+        OBJ_DBG_ASSERT(cpu < m->nprocs);
+        // stopped, cpu's lists and caches are only ours to change (frees
+        // into its slabs still happen)
+        if (_is_no_idx(cpu) || !_stop_cpu(cpu)) {
+            return 0;
+        }
+
+        const uint32_t node =
+            rseq_idx_is_cpu()
+                ? sysi::cpu_to_node(cpu) % m->slab_allocator.nnodes
+                : _cur_node();
+
+        uint64_t nadded = 0;
+        for (uint32_t size_idx = 0; size_idx < num_size_classes; ++size_idx) {
+            slab_manager_t * sm = m->get_sm(cpu, size_idx);
+            uint64_t ncached    = sm->fc.current_idx & (~fc_stopped);
+            OBJ_DBG_ASSERT(ncached <= cache_size);
+            if (!(size_class_mask & ((1UL) << size_idx))) {
+                __atomic_store_n(&(sm->fc.current_idx),
+                                 ncached,
+                                 __ATOMIC_RELEASE);
+                continue;
+            }
+
+            uint64_t navailable = ncached;
+            for (slab_t * slab = sm->available_slabs_head;
+                 slab != NULL && navailable < nobjs;
+                 slab = slab->next) {
+                navailable += slab->_num_available();
+            }
+
+            const uint32_t size = idx_to_size(size_idx);
+            while (navailable < nobjs) {
+                slab_t * slab = _new_slab_on(size_idx, node);
+                if (slab == NULL) {
+                    break;
+                }
+                // (startup is the time to take the faults)
+                const uint64_t page_lo =
+                    cmath::rounddown<uint64_t>((uint64_t)slab, PAGE_SIZE);
+                try_populate_write((void *)page_lo,
+                                   ((uint64_t)slab) + sizeof(slab_t) - page_lo);
+                new ((void * const)slab) slab_t(size);
+                navailable += slab->_num_available();
+                nadded += slab->_num_available();
+
+                // objects in the cache are allocated as far as the slab
+                // knows
+                while (ncached < cache_size) {
+                    const uint64_t ret = slab->_allocate_private();
+                    OBJ_DBG_ASSERT(ret < slab_t::SUCCESS_BOUND);
+                    sm->fc.ptrs[ncached++] =
+                        (uint64_t)(slab->payload + size * ret);
+                }
+
+                slab->next               = sm->available_slabs_head;
+                sm->available_slabs_head = slab;
+            }
+
+            __atomic_store_n(&(sm->fc.current_idx), ncached, __ATOMIC_RELEASE);
+        }
+        return nadded;
+    }
+
+    // Changes whenever cpu's caches do (approximately, a cpu that frees
+    // exactly what it allocated between two calls looks unchanged). 0 if
+    // nothing is cached on cpu. Safe to call from any thread.
+    uint64_t
+    cpu_activity(const uint32_t cpu) {
+        uint64_t activity = 0;
+        for (uint32_t size_idx = 0; size_idx < num_size_classes; ++size_idx) {
+            slab_manager_t * sm = m->get_sm(cpu, size_idx);
+            activity +=
+                __atomic_load_n(&(sm->fc.current_idx), __ATOMIC_RELAXED) +
+                (uint64_t)__atomic_load_n(&(sm->available_slabs_head),
+                                          __ATOMIC_RELAXED);
+        }
+        return activity;
+    }
+
+    // Changes whenever one of cpu's chunks does (i.e it carved a slab or
+    // took a new chunk). Safe to call from any thread.
+    uint64_t
+    chunk_activity(const uint32_t cpu) {
+        uint64_t activity = 0;
+#if SLAB_CHUNK_SIZE
+        for (uint32_t i = 0; i < filler_class_sets; ++i) {
+            activity += __atomic_load_n(&(m->get_sm(cpu, chunk_idx(i))->chunk),
+                                        __ATOMIC_RELAXED);
+        }
+#else
+        (void)(cpu);
+#endif
+        return activity;
+    }
+
+    // Faults in the next nslabs slabs of each of cpu's chunks
+    // (MADV_POPULATE_WRITE) so the first allocations from them don't take
+    // a fault per page of the header and payload. Safe to call from any
+    // thread: populating doesn't change memory, a chunk read while cpu
+    // carves from it at worst populates slabs already in use. Nothing to
+    // do without SLAB_CHUNK_SIZE (or on kernels before 5.14). Returns
+    // bytes of the ranges populated (pages already in are cheap to
+    // populate again and counted too).
+    uint64_t
+    prefault_cpu(const uint32_t cpu, const uint64_t nslabs) {
+        uint64_t bytes = 0;
+#if SLAB_CHUNK_SIZE
+        for (uint32_t i = 0; i < filler_class_sets; ++i) {
+            const uint64_t chunk = __atomic_load_n(
+                &(m->get_sm(cpu, chunk_idx(i))->chunk),
+                __ATOMIC_RELAXED);
+            const uint64_t n = cmath::min<uint64_t>(chunk >> chunk_left_shift,
+                                                    nslabs);
+            if (n == 0) {
+                continue;
+            }
+            const uint64_t lo = chunk & (chunk_one_left - 1);
+            const uint64_t hi = lo + n * sizeof(slab_t);
+            // populate needs page aligned starts
+            const uint64_t page_lo = cmath::rounddown<uint64_t>(lo, PAGE_SIZE);
+            if (try_populate_write((void *)page_lo, hi - page_lo)) {
+                bytes += hi - page_lo;
+            }
+        }
+#else
+        (void)(cpu);
+        (void)(nslabs);
+#endif
+        return bytes;
+    }
+
+    // Re-reads the cpus this process can run on (see
+    // sysi::reachable_cpus) and drains any that have become unreachable.
+    // Cpus that become reachable need nothing, their managers are set up
+    // on first use. Returns number of cpus drained.
+    //
+    // mm_cids are never drained here: after the cpuset shrinks the kernel
+    // only compacts them lazily so threads can keep using ones >= the new
+    // count for a while. nreachable is kept as the highest count seen so
+    // reclaim and the like still visit them.
+    uint32_t
+    resync_cpus() {
+        sysi::cpu_mask_t now;
+        uint32_t         nnow = sysi::reachable_cpus(&now);
+
+        _lock_maintenance();
+        uint32_t ndrained = 0;
+        if (rseq_idx_is_cpu()) {
+            for (uint32_t i = 0; i < m->nprocs; ++i) {
+                if (idx_reachable(&m->reachable, m->nreachable, i) &&
+                    !idx_reachable(&now, nnow, i)) {
+                    _drain_cpu(i);
+                    ++ndrained;
+                }
+            }
+        }
+        else {
+            nnow = cmath::max<uint32_t>(nnow, m->nreachable);
+        }
+        m->reachable  = now;
+        m->nreachable = nnow;
+        _unlock_maintenance();
+        return ndrained;
+    }
+
+    // managers are indexed by cpu, by mm_cid (see rseq_idx_offset) or by
+    // thread (rseq_fallback). The kernel keeps mm_cid below the most cpus
+    // the process has been able to use (see resync_cpus), thread indexes
+    // are always reachable.
+    static uint32_t
+    idx_reachable(const sysi::cpu_mask_t * mask,
+                  const uint32_t           nreachable,
+                  const uint32_t           idx) {
+        if (rseq_fallback) {
+            return 1;
+        }
+        return rseq_idx_is_cpu() ? sysi::cpu_mask_test(mask, idx)
+                                 : idx < nreachable;
+    }
+
     void
     _valid_addr(void * addr) {
         if (addr) {
             uint64_t addr_minus_start = (((uint64_t)addr) % sizeof(slab_t));
             assert(addr_minus_start >= slab_t::payload_offset);
             assert(((uint64_t)addr) >
-                   (calculate_start<slab_t>((uint64_t)(m + 1))));
+                   (calculate_start<slab_t>(((uint64_t)m) + m->meta_size())));
             assert(((uint64_t)addr) < end);
         }
     }
 
     void
     print_status_recap() {
-        for (uint32_t i = 0; i < NPROCS; ++i) {
-            fprintf(stderr, "[%d]", i);
-            m->slab_managers[i].print_status_recap();
+        for (uint32_t i = 0; i < m->nprocs; ++i) {
+            for (uint32_t _i = 0; _i < num_size_classes; ++_i) {
+                fprintf(stderr, "[%d][%d]", i, _i);
+                m->get_sm(i, _i)->print_status_recap();
+            }
         }
     }
 
@@ -511,19 +2392,33 @@ struct object_allocator {
         fprintf(stderr,
                 "[%p ... %p]\n",
                 (void *)calculate_start<slab_t>(
-                    (((uint64_t)m + sizeof(memory_layout_t)))),
-                (void *)calculate_end<slab_t>(
-                    ((uint64_t)m + sizeof(memory_layout_t)),
+                    (((uint64_t)m + m->meta_size()))),
+                (void *)calculate_end<slab_t>(((uint64_t)m + m->meta_size()),
                     get_slab_region_size()));
-        for (uint32_t i = 0; i < NPROCS; ++i) {
+        for (uint32_t i = 0; i < m->nprocs; ++i) {
             for (uint32_t _i = 1; _i < 2; ++_i) {
                 fprintf(stderr, "[%d]", i);
-                m->slab_managers[_i][i].print_status_full();
+                m->get_sm(i, _i)->print_status_full();
             }
         }
     }
 };
 
+template<uint32_t cache_size_lower_bound, typename slab_allocator_t>
+thread_local typename object_allocator<cache_size_lower_bound,
+                                       slab_allocator_t>::hybrid_state
+    object_allocator<cache_size_lower_bound, slab_allocator_t>::hybrid;
+
+template<uint32_t cache_size_lower_bound, typename slab_allocator_t>
+typename object_allocator<cache_size_lower_bound,
+                          slab_allocator_t>::live_list
+    object_allocator<cache_size_lower_bound, slab_allocator_t>::live = {
+        PTHREAD_MUTEX_INITIALIZER,
+        NULL,
+        0,
+        { NULL, NULL, NULL, NULL, NULL, NULL }
+    };
+
 }  // namespace alloc
 
 #undef OBJ_DBG_ASSERT
@@ -0,0 +1,311 @@
+#ifndef _PRESSURE_MONITOR_H_
+#define _PRESSURE_MONITOR_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <misc/cpp_attributes.h>
+#include <misc/error_handling.h>
+#include <system/fork_hooks.h>
+
+#include <concurrency/rseq/rseq_base.h>
+
+namespace alloc {
+
+// Background thread that shrinks the allocator while memory is short so
+// co-located processes don't stall in reclaim, without the allocator
+// having to run lean the rest of the time. On pressure it drains every
+// cpu's caches (object_allocator::reclaim) and gives the free slabs back
+// to the os even where that breaks up huge pages
+// (object_allocator::release_free_memory), at most once per window_us.
+//
+// Pressure is a PSI trigger on /proc/pressure/memory (some task stalled on
+// memory for stall_us within window_us, windows must be multiples of 2s
+// unless privileged) or, where PSI is unavailable, a new high / max / oom
+// event in this process's cgroup v2 memory.events.
+//
+// Like cache_maintenance the thread does not exist in a forked child,
+// there it is stopped and can be start()ed again.
+template<typename allocator_t>
+struct pressure_monitor {
+    enum SOURCE { NONE = 0, PSI = 1, CGROUP_EVENTS = 2 };
+
+    allocator_t * const allocator;
+    const uint64_t      stall_us;
+    const uint64_t      window_us;
+
+    pthread_t       tid;
+    pthread_mutex_t lock;
+    uint32_t        running;
+    uint32_t        source;
+    // the trigger / memory.events and what stop() wakes the thread with
+    int32_t fd;
+    int32_t wake_fd;
+
+    // high + max + oom of memory.events as of the last read
+    uint64_t last_events;
+    uint64_t last_reaction_ns;
+
+    // times reacted, objects and slabs drained, bytes given back
+    uint64_t nreactions;
+    uint64_t ndrained;
+    uint64_t nreleased;
+
+    fork_hooks fork_node;
+
+    pressure_monitor(allocator_t * _allocator,
+                     uint64_t      _stall_us  = 100 * 1000,
+                     uint64_t      _window_us = 2 * 1000 * 1000)
+        : allocator(_allocator),
+          stall_us(_stall_us),
+          window_us(_window_us),
+          running(0),
+          source(NONE),
+          fd(-1),
+          wake_fd(-1),
+          last_events(0),
+          last_reaction_ns(0),
+          nreactions(0),
+          ndrained(0),
+          nreleased(0) {
+        DIE_ASSERT(stall_us && stall_us <= window_us,
+                   "Error stall of %lu us does not fit a %lu us window\n",
+                   stall_us,
+                   window_us);
+        ERROR_ASSERT(!pthread_mutex_init(&lock, NULL));
+
+        fork_node = {
+            _fork_prepare, _fork_parent, _fork_child, this, NULL, NULL
+        };
+        add_fork_hooks(&fork_node);
+    }
+
+    ~pressure_monitor() {
+        remove_fork_hooks(&fork_node);
+        stop();
+        pthread_mutex_destroy(&lock);
+    }
+
+    static void
+    _fork_prepare(void * _this) {
+        pthread_mutex_lock(&(((pressure_monitor *)_this)->lock));
+    }
+
+    static void
+    _fork_parent(void * _this) {
+        pthread_mutex_unlock(&(((pressure_monitor *)_this)->lock));
+    }
+
+    // the fds are shared with the parent (stop() here would wake its
+    // thread) so the child just lets go of them
+    static void
+    _fork_child(void * _this) {
+        pressure_monitor * pm = (pressure_monitor *)_this;
+        if (pm->running) {
+            pm->running = 0;
+            pm->_close();
+        }
+        pthread_mutex_unlock(&(pm->lock));
+    }
+
+    static uint64_t
+    _now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * (1000UL * 1000 * 1000) + ts.tv_nsec;
+    }
+
+    // drains and releases what can be. Can be called directly instead of
+    // waiting for pressure.
+    void
+    react() {
+        ndrained += allocator->reclaim();
+        nreleased += allocator->release_free_memory();
+        last_reaction_ns = _now_ns();
+        ++nreactions;
+    }
+
+    uint32_t
+    _open_psi() {
+        fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            return 0;
+        }
+        char trigger[64];
+        const int32_t len = snprintf(trigger,
+                                     sizeof(trigger),
+                                     "some %lu %lu",
+                                     stall_us,
+                                     window_us);
+        if (write(fd, trigger, len + 1) < 0) {
+            close(fd);
+            fd = -1;
+            return 0;
+        }
+        return 1;
+    }
+
+    // high + max + oom counts in memory.events, ~0 if unreadable
+    uint64_t
+    _read_events() {
+        char          buf[512];
+        const int64_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (len <= 0) {
+            return (~(0UL));
+        }
+        buf[len] = '\0';
+
+        uint64_t events = 0;
+        char *   save;
+        for (char * line = strtok_r(buf, "\n", &save); line != NULL;
+             line        = strtok_r(NULL, "\n", &save)) {
+            if (!strncmp(line, "high ", strlen("high ")) ||
+                !strncmp(line, "max ", strlen("max ")) ||
+                !strncmp(line, "oom ", strlen("oom "))) {
+                events += strtoul(strchr(line, ' ') + 1, NULL, 10);
+            }
+        }
+        return events;
+    }
+
+    uint32_t
+    _open_cgroup_events() {
+        FILE * fp = fopen("/proc/self/cgroup", "r");
+        if (fp == NULL) {
+            return 0;
+        }
+        // the unified hierarchy is the "0::<path>" line
+        char line[512];
+        char path[sizeof(line) + 64];
+        path[0] = '\0';
+        while (fgets(line, sizeof(line), fp)) {
+            if (!strncmp(line, "0::", strlen("0::"))) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(path,
+                         sizeof(path),
+                         "/sys/fs/cgroup%s/memory.events",
+                         line + strlen("0::"));
+                break;
+            }
+        }
+        fclose(fp);
+
+        if (path[0] == '\0') {
+            return 0;
+        }
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return 0;
+        }
+        last_events = _read_events();
+        return 1;
+    }
+
+    void
+    _close() {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (wake_fd >= 0) {
+            close(wake_fd);
+        }
+        fd      = -1;
+        wake_fd = -1;
+        source  = NONE;
+    }
+
+    // 1 if whatever fd reported is pressure
+    uint32_t
+    _is_pressure(const int16_t revents) {
+        if (source == PSI) {
+            return (revents & POLLPRI) != 0;
+        }
+        // memory.events notifies on any change, only some are pressure
+        const uint64_t events = _read_events();
+        const uint32_t more   = events != (~(0UL)) && events > last_events;
+        last_events           = events;
+        return more;
+    }
+
+    static void *
+    monitor_loop(void * _this) {
+        pressure_monitor * pm = (pressure_monitor *)_this;
+        // reclaims other cpus of a multi process heap from there
+        rseq_may_migrate = 1;
+
+        struct pollfd fds[2];
+        fds[0] = { pm->fd, POLLPRI, 0 };
+        fds[1] = { pm->wake_fd, POLLIN, 0 };
+        while (1) {
+            if (poll(fds, 2, -1) < 0) {
+                ERROR_ASSERT(errno == EINTR);
+                continue;
+            }
+            if (fds[1].revents) {
+                break;
+            }
+            // PSI: the trigger is gone (e.g its cgroup was removed)
+            if (pm->source == PSI && (fds[0].revents & POLLERR)) {
+                break;
+            }
+            if (fds[0].revents && pm->_is_pressure(fds[0].revents) &&
+                _now_ns() - pm->last_reaction_ns >= pm->window_us * 1000) {
+                pm->react();
+            }
+        }
+        return NULL;
+    }
+
+    // returns source watched, NONE if neither is available (nothing
+    // started)
+    uint32_t
+    start() {
+        pthread_mutex_lock(&lock);
+        if (!running) {
+            if (_open_psi()) {
+                source = PSI;
+            }
+            else if (_open_cgroup_events()) {
+                source = CGROUP_EVENTS;
+            }
+
+            if (source != NONE) {
+                wake_fd = eventfd(0, EFD_CLOEXEC);
+                ERROR_ASSERT(wake_fd >= 0);
+                running = 1;
+                ERROR_ASSERT(
+                    !pthread_create(&tid, NULL, monitor_loop, this));
+            }
+        }
+        const uint32_t ret = source;
+        pthread_mutex_unlock(&lock);
+        return ret;
+    }
+
+    // the thread never takes lock so it's held throughout
+    void
+    stop() {
+        pthread_mutex_lock(&lock);
+        if (running) {
+            running            = 0;
+            const uint64_t one = 1;
+            ERROR_ASSERT(write(wake_fd, &one, sizeof(one)) == sizeof(one));
+            ERROR_ASSERT(!pthread_join(tid, NULL));
+            _close();
+        }
+        pthread_mutex_unlock(&lock);
+    }
+};
+
+}  // namespace alloc
+
+#endif
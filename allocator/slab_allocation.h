@@ -3,37 +3,354 @@
 
 #include <concurrency/rseq/rseq_base.h>
 #include <misc/cpp_attributes.h>
+#include <misc/error_handling.h>
 #include <optimized/const_math.h>
+#include <system/mmap_helpers.h>
 #include <system/sys_info.h>
 
+#include <allocator/slab_size_classes.h>
+
 
 #define SLAB_ALLOCATION_ASSERT(X) assert(X)
 
+// log2 of the address space each size class gets with
+// size_class_slab_allocator
+#ifndef SIZE_CLASS_SPAN_BITS
+#define SIZE_CLASS_SPAN_BITS 32
+#endif
+
+// most numa nodes the region is split between (nodes past it share with
+// lower ones). 1 -> no numa handling at all
+#ifndef SLAB_NUMA_NODES
+#define SLAB_NUMA_NODES 8
+#endif
+
 namespace new_memory {
 enum FAILURE { MIGRATED = 1 };
 
+static uint32_t
+slab_numa_nodes() {
+    return SLAB_NUMA_NODES > 1 ? cmath::min<uint32_t>(NNODES, SLAB_NUMA_NODES)
+                               : 1;
+}
+
+// slab_allocator_t policies for object_allocator. Both hand out chunks of
+// contiguous slabs from [slab_start, region_end), split into one range per
+// numa node (nnodes of them, boundaries on huge pages so no huge page or
+// slab is on two nodes):
+//
+// partitioned         -> 1 if the size class of any object can be computed
+//                        from its address (addr_to_size_idx)
+// default_region_size -> region object_allocator maps if not given one
+// region_align        -> what the region's start must be a multiple of
+//
+// _new_chunk(node, size_idx, nslabs, nslabs_out) -> up to nslabs slabs for
+//                        size_idx from node's range (other nodes' once it
+//                        runs out, fewer slabs at the very end, count in
+//                        nslabs_out), NULL if out of memory
+// _return_chunk(size_idx, chunk, nslabs)   -> give back an unused chunk if
+//                        nothing was taken after it
+// addr_to_node(addr)  -> node whose range addr is in
+// for_each_node_range(f) -> f(node, start, end) for every range
+// for_each_used(f)    -> f(start, bytes) for every range of slabs handed
+//                        out so far
+// release_used(advice) -> gives back the pages of every slab that was
+//                        handed out (madv_release with advice), not thread
+//                        safe
+
+struct slab_range {
+    uint64_t current_slab;
+    uint64_t start;
+    uint64_t end;
+
+    // [lo, hi) rounded in to whole slabs
+    void
+    init(const uint64_t lo, const uint64_t hi, const uint64_t slab_size) {
+        current_slab = cmath::roundup<uint64_t>(lo, slab_size);
+        start        = current_slab;
+        end          = cmath::max<uint64_t>(
+            current_slab,
+            cmath::rounddown<uint64_t>(hi, slab_size));
+    }
+
+    uint64_t
+    _new_chunk(const uint64_t bytes) {
+        if (__atomic_load_n(&current_slab, __ATOMIC_RELAXED) >= end) {
+            return 0;
+        }
+        const uint64_t chunk =
+            __atomic_fetch_add(&current_slab, bytes, __ATOMIC_RELAXED);
+        return chunk >= end ? 0 : chunk;
+    }
+
+    uint32_t
+    _return_chunk(const uint64_t chunk, const uint64_t bytes) {
+        uint64_t expected = chunk + bytes;
+        return __atomic_compare_exchange_n(&current_slab,
+                                           &expected,
+                                           chunk,
+                                           false,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED);
+    }
+
+    // [lo, lo + bytes) zeroed, lo the start of a range and bytes its used().
+    // Whole pages are dropped, the one lo is in may hold the metadata so is
+    // written. Ranges end page aligned so the rest of the last page is
+    // unused.
+    static void
+    release(const uint64_t lo, const uint64_t bytes, const int32_t advice) {
+        const uint64_t page_lo = cmath::roundup<uint64_t>(lo, PAGE_SIZE);
+        const uint64_t page_hi =
+            cmath::roundup<uint64_t>(lo + bytes, PAGE_SIZE);
+        memset((void *)lo, 0, cmath::min<uint64_t>(page_lo, lo + bytes) - lo);
+        if (page_hi > page_lo) {
+            madv_release((void *)page_lo, page_hi - page_lo, advice);
+        }
+    }
+
+    uint64_t
+    used() const {
+        return cmath::min<uint64_t>(
+                   __atomic_load_n(&current_slab, __ATOMIC_RELAXED),
+                   end) -
+               start;
+    }
+} L2_LOAD_ALIGN;
+
 template<typename slab_t>
 struct shared_memory_slab_allocator {
-    uint64_t current_slab;
+    static constexpr uint32_t partitioned = 0;
+
+    // will default to approximately a few gb of unreserve memory
+    static constexpr uint64_t default_region_size = ((1UL) << 31);
+    static constexpr uint64_t region_align        = PAGE_SIZE;
+
+    const uint32_t nnodes;
+    // node n starts at node_base + n * node_span (node 0 at slab_start)
+    uint64_t   node_base;
+    uint64_t   node_span;
+    slab_range nodes[SLAB_NUMA_NODES];
 
     // this is done at initialization so no need to optimize.
     // Basically we just want current_slab to be aligned to
     // sizeof(slab) so that free can find its slab with modulo
-    shared_memory_slab_allocator(uint64_t mem_region)
-        : current_slab(mem_region) {
-        SLAB_ALLOCATION_ASSERT(current_slab % sizeof(slab_t) == 0);
+    shared_memory_slab_allocator(uint64_t slab_start,
+                                 uint64_t region_end,
+                                 uint32_t _nnodes)
+        : nnodes(_nnodes) {
+        SLAB_ALLOCATION_ASSERT(slab_start % sizeof(slab_t) == 0);
+        SLAB_ALLOCATION_ASSERT(nnodes && nnodes <= SLAB_NUMA_NODES);
+
+        node_base = cmath::rounddown<uint64_t>(slab_start, HUGE_PAGE_SIZE);
+        node_span = cmath::roundup<uint64_t>(
+            (region_end - node_base + nnodes - 1) / nnodes,
+            HUGE_PAGE_SIZE);
+        for (uint32_t n = 0; n < nnodes; ++n) {
+            const uint64_t lo = cmath::max<uint64_t>(node_base + n * node_span,
+                                                     slab_start);
+            const uint64_t hi =
+                n == nnodes - 1
+                    ? region_end
+                    : cmath::min<uint64_t>(node_base + (n + 1) * node_span,
+                                           region_end);
+            nodes[n].init(cmath::min<uint64_t>(lo, hi), hi, sizeof(slab_t));
+        }
+    }
+
+    uint32_t
+    addr_to_node(const uint64_t addr) const {
+        return cmath::min<uint64_t>((addr - node_base) / node_span,
+                                    nnodes - 1);
+    }
+
+    slab_t *
+    _new_chunk(const uint32_t node,
+               const uint32_t size_idx,
+               const uint64_t nslabs,
+               uint64_t *     nslabs_out) {
+        (void)(size_idx);
+        for (uint32_t i = 0; i < nnodes; ++i) {
+            slab_range * const r = nodes + ((node + i) % nnodes);
+
+            const uint64_t chunk = r->_new_chunk(nslabs * sizeof(slab_t));
+            if (chunk) {
+                *nslabs_out = cmath::min<uint64_t>(
+                    nslabs,
+                    (r->end - chunk) / sizeof(slab_t));
+                return (slab_t *)chunk;
+            }
+        }
+        return NULL;
     }
 
-    uint32_t ALWAYS_INLINE PURE_ATTR
-    out_of_memory(uint64_t end) const {
-        return (current_slab >= end);
+    uint32_t
+    _return_chunk(const uint32_t size_idx,
+                  slab_t *       chunk,
+                  const uint64_t nslabs) {
+        (void)(size_idx);
+        return nodes[addr_to_node((uint64_t)chunk)]._return_chunk(
+            (uint64_t)chunk,
+            nslabs * sizeof(slab_t));
+    }
+
+    template<typename F>
+    void
+    for_each_node_range(F f) const {
+        for (uint32_t n = 0; n < nnodes; ++n) {
+            f(n, nodes[n].start, nodes[n].end);
+        }
+    }
+
+    template<typename F>
+    void
+    for_each_used(F f) const {
+        for (uint32_t n = 0; n < nnodes; ++n) {
+            const uint64_t used = nodes[n].used();
+            if (used) {
+                f(nodes[n].start, used);
+            }
+        }
+    }
+
+    void
+    release_used(const int32_t advice) {
+        for_each_used([&](uint64_t lo, uint64_t bytes) {
+            slab_range::release(lo, bytes, advice);
+        });
+    }
+};
+
+
+// Every size class gets its own 1 << log_class_span bytes of the region
+// (class i at region + i * class_span) so the class of an object is just
+// bits of its address and freeing doesn't need to read the slab. The
+// metadata at the start of the region comes out of class 0's span. Costs
+// address space only: spans are reserved, not committed. Each span is
+// split between the nodes.
+template<typename slab_t, uint32_t log_class_span = SIZE_CLASS_SPAN_BITS>
+struct size_class_slab_allocator {
+    static constexpr uint32_t partitioned = 1;
+
+    static constexpr uint64_t class_span = (1UL) << log_class_span;
+    static constexpr uint64_t class_mask =
+        cmath::next_p2<uint32_t>(num_size_classes) - 1;
+
+    static constexpr uint64_t default_region_size =
+        class_span * num_size_classes;
+    // region must start at a multiple of the span of all the classes (as a
+    // power of 2) so that the class bits start at 0
+    static constexpr uint64_t region_align = class_span * (class_mask + 1);
+
+    static_assert(class_span > 4 * sizeof(slab_t));
+
+    const uint32_t nnodes;
+    uint64_t       base;
+    // of each class's span
+    uint64_t   node_span;
+    slab_range classes[num_size_classes][SLAB_NUMA_NODES];
+
+    size_class_slab_allocator(uint64_t slab_start,
+                              uint64_t region_end,
+                              uint32_t _nnodes)
+        : nnodes(_nnodes) {
+        SLAB_ALLOCATION_ASSERT(nnodes && nnodes <= SLAB_NUMA_NODES);
+        base = cmath::rounddown<uint64_t>(slab_start, region_align);
+        node_span =
+            cmath::rounddown<uint64_t>(class_span / nnodes, HUGE_PAGE_SIZE);
+        DIE_ASSERT(region_end - base > (num_size_classes - 1) * class_span &&
+                       region_end - base <= region_align &&
+                       base + region_align <= ((1UL) << (VM_NBITS - 1)),
+                   "Error size class partition needs a region of up to %lu "
+                   "bytes at a multiple of that\n",
+                   region_align);
+        DIE_ASSERT(node_span > 4 * sizeof(slab_t),
+                   "Error size class span too small for %d nodes\n",
+                   nnodes);
+
+        for (uint32_t i = 0; i < num_size_classes; ++i) {
+            for (uint32_t n = 0; n < nnodes; ++n) {
+                const uint64_t span_lo = base + i * class_span + n * node_span;
+                const uint64_t span_hi = n == nnodes - 1
+                                             ? base + (i + 1) * class_span
+                                             : span_lo + node_span;
+                const uint64_t hi =
+                    cmath::min<uint64_t>(span_hi, region_end);
+                const uint64_t lo = cmath::min<uint64_t>(
+                    cmath::max<uint64_t>(span_lo, slab_start),
+                    hi);
+                classes[i][n].init(lo, hi, sizeof(slab_t));
+            }
+        }
+    }
+
+    static uint32_t ALWAYS_INLINE CONST_ATTR
+    addr_to_size_idx(const uint64_t addr) {
+        return (addr >> log_class_span) & class_mask;
+    }
+
+    uint32_t
+    addr_to_node(const uint64_t addr) const {
+        return cmath::min<uint64_t>((addr & (class_span - 1)) / node_span,
+                                    nnodes - 1);
     }
 
     slab_t *
-    _new() {
-        return (slab_t *)__atomic_fetch_add(&current_slab,
-                                            sizeof(slab_t),
-                                            __ATOMIC_RELAXED);
+    _new_chunk(const uint32_t node,
+               const uint32_t size_idx,
+               const uint64_t nslabs,
+               uint64_t *     nslabs_out) {
+        for (uint32_t i = 0; i < nnodes; ++i) {
+            slab_range * const r = classes[size_idx] + ((node + i) % nnodes);
+
+            const uint64_t chunk = r->_new_chunk(nslabs * sizeof(slab_t));
+            if (chunk) {
+                *nslabs_out = cmath::min<uint64_t>(
+                    nslabs,
+                    (r->end - chunk) / sizeof(slab_t));
+                return (slab_t *)chunk;
+            }
+        }
+        return NULL;
+    }
+
+    uint32_t
+    _return_chunk(const uint32_t size_idx,
+                  slab_t *       chunk,
+                  const uint64_t nslabs) {
+        return classes[size_idx][addr_to_node((uint64_t)chunk)]._return_chunk(
+            (uint64_t)chunk,
+            nslabs * sizeof(slab_t));
+    }
+
+    template<typename F>
+    void
+    for_each_node_range(F f) const {
+        for (uint32_t i = 0; i < num_size_classes; ++i) {
+            for (uint32_t n = 0; n < nnodes; ++n) {
+                f(n, classes[i][n].start, classes[i][n].end);
+            }
+        }
+    }
+
+    template<typename F>
+    void
+    for_each_used(F f) const {
+        for (uint32_t i = 0; i < num_size_classes; ++i) {
+            for (uint32_t n = 0; n < nnodes; ++n) {
+                const uint64_t used = classes[i][n].used();
+                if (used) {
+                    f(classes[i][n].start, used);
+                }
+            }
+        }
+    }
+
+    void
+    release_used(const int32_t advice) {
+        for_each_used([&](uint64_t lo, uint64_t bytes) {
+            slab_range::release(lo, bytes, advice);
+        });
     }
 };
 
@@ -20,10 +20,12 @@ struct slab_manager {
     enum FAILURE { ANY = 1 };
     static constexpr uint64_t SUCCESS_BOUND = ANY;
 
-    // maybe drop entire free list and just use head and tail of available list
-    // and append free slabs to tail...
+    // slabs are pushed / popped at the head only. A tail can't be kept
+    // consistent with a single commit store so there is none.
     slab_t *               available_slabs_head;
-    slab_t *               available_slabs_tail;
+    // the chunk of new slabs the cpu carves from, only in the managers
+    // object_allocator::chunk_idx picks
+    uint64_t               chunk;
     free_cache<cache_size> fc;
 
 
@@ -59,6 +61,10 @@ struct slab_manager {
 
             "cmpq %[temp_ptr], %[expected_slab]\n\t"
             "jne %l[failure]\n\t"
+
+            // being drained (see free_cache::STOPPED)
+            "cmpq $0, 16(%[_this])\n\t"
+            "js %l[failure]\n\t"
             
             // available_slabs = slab;
 
@@ -71,11 +77,11 @@ struct slab_manager {
             "jmp 1b\n\t"
             RSEQ_END_ABORT_DEF()
             
-            :
+            : [ temp_ptr ] "=&r" (temp_ptr)
             : [ expected_slab ] "r" (expected_slab),
-              [ temp_ptr ] "r" (temp_ptr),
               [ _this ] "r"(this),
-              [ start_cpu ] "r"(start_cpu)
+              [ start_cpu ] "r"(start_cpu),
+              RSEQ_AREA_OPERANDS()
             : "cc", "memory"
             : failure);
         // clang-format on
@@ -89,9 +95,8 @@ struct slab_manager {
     void
     print_status_recap() {
         fprintf(stderr,
-                "Available Slabs [ %p ... %p ]\n\t->",
-                available_slabs_head,
-                available_slabs_tail);
+                "Available Slabs [ %p ... ]\n\t->",
+                available_slabs_head);
 
         slab_t * tmp = available_slabs_head;
         while (tmp) {
@@ -104,9 +109,8 @@ struct slab_manager {
     void
     print_status_full() {
         fprintf(stderr,
-                "Available Slabs [ %p ... %p ]\n\t->",
-                available_slabs_head,
-                available_slabs_tail);
+                "Available Slabs [ %p ... ]\n\t->",
+                available_slabs_head);
 
         slab_t * tmp = available_slabs_head;
 
@@ -118,6 +122,9 @@ struct slab_manager {
     }
 } L2_LOAD_ALIGN;
 
+// critical sections reach the free cache idx from the list head
+static_assert(offsetof(slab_manager<obj_slab>, fc) == 16);
+
 #undef SM_DBG_ASSERT
 
 #endif
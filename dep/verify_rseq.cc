@@ -11,8 +11,15 @@ const uint32_t retries = 10;
 
 int
 main() {
+    if (rseq_fallback) {
+        fprintf(stderr, "rseq unavailable, allocator will use fallback\n");
+        return 0;
+    }
+    // main thread is already registered by a constructor
+#if !RSEQ_AUTO_REGISTER
     DIE_ASSERT(rseq_refcount == 0,
                "Error: Invalid refcount for verifying rseq\n");
+#endif
     init_thread();
 
     uint32_t i;
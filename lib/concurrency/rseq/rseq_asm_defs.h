@@ -54,7 +54,7 @@
 //   "leaq 3b (%%rip), (%%fs:__rseq_abi@tpoff+8)\n\t"           
 #define RSEQ_PREP_CS_DEF(TEMP_REGISTER)                               \
     "leaq 3b (%%rip), " V_TO_STR(TEMP_REGISTER) "\n\t"                         \
-    "movq " V_TO_STR(TEMP_REGISTER) ", %%fs:__rseq_abi@tpoff+8\n\t"          \
+    "movq " V_TO_STR(TEMP_REGISTER) ", %%fs:(%[rseq_cs])\n\t"                \
 
 
 
@@ -63,9 +63,19 @@
     "movq %%rax, 8(%[rseq_abi])\n\t"    // store in ptr field in __rseq_abi
 */
 
+// the rseq area may be libc's (at a runtime offset from %fs) and the per-cpu
+// index field (cpu_id or mm_cid) is picked at runtime so critical sections
+// take their %fs relative addresses as operands: RSEQ_AREA_OPERANDS() in
+// the input list
+#define RSEQ_AREA_OPERANDS()                                                   \
+    [ rseq_idx ] "r" (rseq_idx_tpoff), [ rseq_cs ] "r" (rseq_cs_tpoff)
+
+#define RSEQ_LOAD_CUR_IDX(REGISTER)                                            \
+    "movl %%fs:(%[rseq_idx]), " V_TO_STR(REGISTER) "\n\t"
+
 //"cmpl %[start_cpu], 4(%[rseq_abi])\n\t"                             
 #define RSEQ_CMP_CUR_VS_START_CPUS()                                           \
-    "cmpl %[start_cpu], %%fs:__rseq_abi@tpoff+4\n\t"
+    "cmpl %[start_cpu], %%fs:(%[rseq_idx])\n\t"
 
 /*
     "cmpl %[start_cpu], 4(%[rseq_abi])\n\t" // get cpu in 4(%[rseq_abi]) and
@@ -80,6 +90,7 @@
     ".byte 0x0f, 0xb9, 0x3d\n\t"                                               \
     ".long 0x53053053\n\t"                                                     \
     "4:\n\t"                                                                   \
+    "addl $1, %%fs:rseq_abort_count@tpoff\n\t"                                 \
     ""
 /*
   ".pushsection __rseq_failure, \"ax\"\n\t" // create failure section
@@ -88,6 +99,7 @@
     ".long 0x53053053\n\t"                  // invalid operation to avoid code
                                                injection 
     "4:\n\t"                                // abort label
+    "addl $1, %%fs:rseq_abort_count@tpoff\n\t" // count abort
     ""                                      // not sure why this is needed
 */
 
@@ -123,7 +135,8 @@ foo(..., uint32_t start_cpu)
     RSEQ_END_ABORT_DEF()
     : <output variables, only if NOT goto asm>
     : <input variables> +
-     [ start_cpu ] "r"(start_cpu), // required
+     [ start_cpu ] "r"(start_cpu), // required (from get_start_idx())
+     RSEQ_AREA_OPERANDS(),         // required
      [ rseq_abi ] "g"(&__rseq_abi) // required
     : <clobber registers> +
       "memory", "cc" // minimum clobbers
@@ -1,11 +1,28 @@
 #ifndef _RSEQ_DEFINES_H_
 #define _RSEQ_DEFINES_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/syscall.h>
 
 // for now these really need to be #defines
 #define RSEQ_SIGNATURE 0x53053053
-#define NR_rseq  334
+#ifdef __NR_rseq
+#define NR_rseq __NR_rseq
+#else
+#define NR_rseq 334
+#endif
+
+#ifdef __NR_membarrier
+#define NR_membarrier __NR_membarrier
+#else
+#define NR_membarrier 324
+#endif
+
+// from linux/membarrier.h (linux >= 5.10), older headers don't have them
+#define RSEQ_MEMBARRIER_CMD_FENCE    (1 << 7)
+#define RSEQ_MEMBARRIER_CMD_REGISTER (1 << 8)
+#define RSEQ_MEMBARRIER_FLAG_CPU     (1 << 0)
 
 
 enum rseq_cpu_id_state {
@@ -46,8 +63,25 @@ struct _rseq_def {
     uint32_t cpu_id;
     uint64_t ptr;
     uint32_t flags;
+    // these two are only filled in by kernels >= 6.3 (see
+    // rseq_mm_cid_supported)
+    uint32_t node_id;
+    uint32_t mm_cid;
 } __attribute__((aligned(32)));
 
+// offsets used in asm
+#define RSEQ_CPU_ID_START_OFFSET 0
+#define RSEQ_CPU_ID_OFFSET       4
+#define RSEQ_PTR_OFFSET          8
+#define RSEQ_NODE_ID_OFFSET      20
+#define RSEQ_MM_CID_OFFSET       24
+
+static_assert(offsetof(struct _rseq_def, cpu_id) == RSEQ_CPU_ID_OFFSET);
+static_assert(offsetof(struct _rseq_def, ptr) == RSEQ_PTR_OFFSET);
+static_assert(offsetof(struct _rseq_def, node_id) == RSEQ_NODE_ID_OFFSET);
+static_assert(offsetof(struct _rseq_def, mm_cid) == RSEQ_MM_CID_OFFSET);
+static_assert(sizeof(struct _rseq_def) == 32);
+
 typedef struct _rseq_def rseq_def;
 typedef struct _rseq_info rseq_info;
 
@@ -56,8 +90,21 @@ typedef struct _rseq_info rseq_info;
 #define _GENERIC_RSEQ_OTHER_FAILURE 1
 #define _GENERIC_RSEQ_SUCCES 0
 
+// only registered if libc has not already registered its own area (see
+// rseq_area)
 __thread rseq_def __rseq_abi;
 __thread uint32_t rseq_refcount = 0;
 
+// incremented by every abort handler (RSEQ_START_ABORT_DEF). Callers reset
+// it at the start of an operation to bound how long it retries.
+__thread uint32_t rseq_abort_count;
+
+// aborts within one operation after which it stops retrying rseq and takes
+// a path without it (see object_allocator::_allocate_private and
+// hybrid_state). 0 -> always retry.
+#ifndef RSEQ_HYBRID_ABORTS
+#define RSEQ_HYBRID_ABORTS 16
+#endif
+
 
 #endif
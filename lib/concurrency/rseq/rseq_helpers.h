@@ -1,19 +1,410 @@
 #ifndef _RSEQ_HELPERS_H_
 #define _RSEQ_HELPERS_H_
 
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/auxv.h>
 #include <sys/syscall.h>
 #include <syscall.h>
 #include <unistd.h>
 
 #include <misc/cpp_attributes.h>
 #include <misc/error_handling.h>
+#include <system/cpu_topology.h>
+#include <system/fork_hooks.h>
 
 #include "rseq_defines.h"
+#include "rseq_thread_hook.h"
 
 #define RSEQ_SAFE_ACCESS(X)   (*(__volatile__ __typeof__(X) *)&(X))
 #define RSEQ_SAFE_WRITE(X, Y) RSEQ_SAFE_ACCESS(X) = (Y)
 
+// 1 -> index per-cpu structures by mm_cid if the kernel provides it. mm_cid
+// is dense per process and bounded by the number of concurrently running
+// threads so a process with a few threads only warms a few caches.
+// 0 -> always index by cpu_id
+#ifndef RSEQ_USE_MM_CID
+#define RSEQ_USE_MM_CID 1
+#endif
+
+// What to do without rseq (old kernels, gVisor, seccomp):
+// 0 -> nothing, rseq must work
+// 1 -> detect at startup and fall back to per-thread indexes if missing
+// 2 -> always use per-thread indexes (testing)
+#ifndef RSEQ_FALLBACK
+#define RSEQ_FALLBACK 1
+#endif
+
+// number of per-thread indexes in fallback mode. Threads alive at once past
+// RSEQ_FALLBACK_MAX_THREADS - 2 share one index under a lock.
+#ifndef RSEQ_FALLBACK_MAX_THREADS
+#define RSEQ_FALLBACK_MAX_THREADS 1024
+#endif
+
+// 1 -> register every thread before it runs any user code: the main thread
+// from a constructor and all others through the pthread_create wrapper
+// (see rseq_thread_hook.h, needs -Wl,--wrap=pthread_create unless libc
+// registers rseq itself), so callers never need init_thread() and the
+// fast path never checks. Without it an unregistered thread would use cpu
+// 0's caches unprotected.
+#ifndef RSEQ_AUTO_REGISTER
+#define RSEQ_AUTO_REGISTER 1
+#endif
+
+#ifndef AT_RSEQ_FEATURE_SIZE
+#define AT_RSEQ_FEATURE_SIZE 27
+#endif
+
+
+// glibc >= 2.35 registers an rseq area for every thread itself (unless
+// disabled with glibc.pthread.rseq=0) and exports where it is. A thread can
+// only have one area registered so if it exists we have to use it. Weak so
+// still links against older libcs.
+extern "C" {
+extern const ptrdiff_t    __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+}
+
+uint32_t
+rseq_libc_registered() {
+    return (&__rseq_size != NULL) && __rseq_size != 0;
+}
+
+// invalid arguments so if the syscall exists this is EINVAL. Unsupported /
+// filtered is ENOSYS or EPERM.
+uint32_t
+rseq_available() {
+    if (rseq_libc_registered()) {
+        return 1;
+    }
+    return syscall(NR_rseq, NULL, 0, 0, 0) == -1 && errno == EINVAL;
+}
+
+uint32_t
+rseq_select_fallback() {
+    if (RSEQ_FALLBACK == 2) {
+        return 1;
+    }
+    return RSEQ_FALLBACK && !rseq_available();
+}
+
+// Fallback mode: __rseq_abi is never registered, instead each thread gets
+// a unique index written to its cpu_id_start / cpu_id. The critical
+// sections are unchanged, they just never abort, which is fine as no
+// other thread ever uses the same index. Fixed at startup (rseq_init).
+uint32_t rseq_fallback;
+
+// kernel advertises how much of struct rseq it fills in
+uint32_t
+rseq_mm_cid_supported() {
+    return getauxval(AT_RSEQ_FEATURE_SIZE) >=
+           RSEQ_MM_CID_OFFSET + sizeof(uint32_t);
+}
+
+// node_id came with mm_cid
+uint32_t
+rseq_node_id_supported() {
+    return getauxval(AT_RSEQ_FEATURE_SIZE) >=
+           RSEQ_NODE_ID_OFFSET + sizeof(uint32_t);
+}
+
+uint64_t
+rseq_select_idx_offset() {
+    if (RSEQ_USE_MM_CID && !rseq_fallback && rseq_mm_cid_supported()) {
+        return RSEQ_MM_CID_OFFSET;
+    }
+    return RSEQ_CPU_ID_OFFSET;
+}
+
+// offset in struct rseq of the field used as the per-cpu index (cpu_id or
+// mm_cid). Fixed at startup (rseq_init).
+uint64_t rseq_idx_offset;
+
+// offset from the thread pointer of the rseq area the kernel updates for
+// this thread. Either libc's or __rseq_abi, both are static tls so the
+// offset is the same for every thread.
+int64_t
+rseq_select_area_offset() {
+    if (rseq_libc_registered() && !rseq_fallback) {
+        return __rseq_offset;
+    }
+    return ((int64_t)(&__rseq_abi)) - ((int64_t)__builtin_thread_pointer());
+}
+
+int64_t rseq_area_offset;
+
+// kernel keeps node_id of the rseq area current (not in fallback mode)
+uint32_t rseq_has_node_id;
+
+// %fs relative addresses passed to the critical sections as
+// RSEQ_AREA_OPERANDS
+int64_t rseq_idx_tpoff;
+int64_t rseq_cs_tpoff;
+
+static void rseq_register_new_thread();
+
+// Runs before any ordinary static initializer (so a global allocator is
+// constructed with the mode already chosen). Everything above is fixed
+// from here on.
+static void __attribute__((constructor(101)))
+rseq_init() {
+    rseq_fallback    = rseq_select_fallback();
+    rseq_idx_offset  = rseq_select_idx_offset();
+    rseq_area_offset = rseq_select_area_offset();
+    rseq_has_node_id = !rseq_fallback && rseq_node_id_supported();
+    rseq_idx_tpoff   = rseq_area_offset + rseq_idx_offset;
+    rseq_cs_tpoff    = rseq_area_offset + RSEQ_PTR_OFFSET;
+
+    // libc registers its own area for every thread
+    if (RSEQ_AUTO_REGISTER && (rseq_fallback || !rseq_libc_registered())) {
+        DIE_ASSERT(rseq_set_thread_hook(rseq_register_new_thread),
+                   "Error RSEQ_AUTO_REGISTER needs linking with "
+                   "-Wl,--wrap=pthread_create (see rseq_thread_hook.h)\n");
+    }
+}
+
+ALWAYS_INLINE PURE_ATTR rseq_def *
+rseq_area() {
+    return (rseq_def *)(((uint64_t)__builtin_thread_pointer()) +
+                        rseq_area_offset);
+}
+
+uint32_t ALWAYS_INLINE PURE_ATTR
+rseq_idx_is_cpu() {
+    return rseq_idx_offset == RSEQ_CPU_ID_OFFSET && !rseq_fallback;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Fences for touching another cpu's (or mm_cid's) structures. Once
+// rseq_fence(idx) returns every critical section that was running on idx
+// has committed or aborted, any started later sees stores made before the
+// fence. Needs a one time registration (per process, so again after
+// fork), done on first use. Never supported in fallback mode: there is no
+// rseq to abort.
+enum rseq_fence_states { FENCE_UNKNOWN = 0, FENCE_OK = 1, FENCE_NONE = 2 };
+uint32_t rseq_fence_state;
+
+uint32_t
+rseq_fence_supported() {
+    uint32_t state = __atomic_load_n(&rseq_fence_state, __ATOMIC_ACQUIRE);
+    if (BRANCH_UNLIKELY(state == FENCE_UNKNOWN)) {
+        // registering is idempotent so racing here is fine
+        state = (!rseq_fallback &&
+                 syscall(NR_membarrier, RSEQ_MEMBARRIER_CMD_REGISTER, 0, 0) ==
+                     0)
+                    ? FENCE_OK
+                    : FENCE_NONE;
+        __atomic_store_n(&rseq_fence_state, state, __ATOMIC_RELEASE);
+    }
+    return state == FENCE_OK;
+}
+
+void
+rseq_fence(const uint32_t idx) {
+    // whichever thread holds an mm_cid may be running on any cpu
+    if (rseq_idx_is_cpu()) {
+        ERROR_ASSERT(!syscall(NR_membarrier,
+                              RSEQ_MEMBARRIER_CMD_FENCE,
+                              RSEQ_MEMBARRIER_FLAG_CPU,
+                              idx),
+                     "Error fencing cpu %d\n",
+                     idx);
+    }
+    else {
+        ERROR_ASSERT(
+            !syscall(NR_membarrier, RSEQ_MEMBARRIER_CMD_FENCE, 0, 0),
+            "Error fencing rseq\n");
+    }
+}
+
+
+// set by threads that only do maintenance (e.g cache_maintenance's), the
+// only ones rseq_on_cpu moves to another cpu. Any other thread is the
+// application's, it stays where the scheduler put it.
+__thread uint32_t rseq_may_migrate;
+
+// rseq_fence(cpu) for per-cpu structures shared with other processes
+// (membarrier only reaches this one's threads), cpu_id indexing only:
+// f() runs with the calling thread pinned to cpu so every critical section
+// on cpu it preempted aborts and any started after sees f()'s stores.
+// Returns 0 without calling f if the thread can't run on cpu (e.g outside
+// its cpuset) or it is not on cpu and not rseq_may_migrate.
+template<typename F>
+uint32_t
+rseq_on_cpu(const uint32_t cpu, F f) {
+    sysi::cpu_mask_t prev, only;
+    if (cpu >= sysi::max_possible_cpus ||
+        (!rseq_may_migrate && sched_getcpu() != (int32_t)cpu) ||
+        sched_getaffinity(0, sizeof(prev.bits), (cpu_set_t *)prev.bits)) {
+        return 0;
+    }
+    memset(&only, 0, sizeof(only));
+    only.bits[cpu / 64] = (1UL) << (cpu % 64);
+    if (sched_setaffinity(0, sizeof(only.bits), (cpu_set_t *)only.bits)) {
+        return 0;
+    }
+    // the kernel migrates the caller before returning, this is just in
+    // case
+    while (sched_getcpu() != (int32_t)cpu) {
+        sched_yield();
+    }
+    f();
+    ERROR_ASSERT(
+        !sched_setaffinity(0, sizeof(prev.bits), (cpu_set_t *)prev.bits),
+        "Error restoring affinity\n");
+    return 1;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Fallback index management. Index 0 is never handed out: it is what a
+// thread without an index of its own sees (not registered, already
+// released its index on exit, or there were none left) and per-index
+// structures keep their fast paths on it failing (e.g a cache that is
+// always STOPPED). Their slow paths then run on index 1 under a lock
+// instead (see rseq_fallback_run_shared).
+static constexpr uint32_t rseq_fallback_no_idx     = 0;
+static constexpr uint32_t rseq_fallback_shared_idx = 1;
+
+pthread_mutex_t rseq_fallback_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t   rseq_fallback_key;
+uint32_t        rseq_fallback_next = rseq_fallback_shared_idx + 1;
+uint32_t        rseq_fallback_nfree;
+uint32_t        rseq_fallback_free[RSEQ_FALLBACK_MAX_THREADS];
+
+pthread_mutex_t rseq_fallback_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+rseq_fallback_set_idx(const uint32_t idx) {
+    RSEQ_SAFE_WRITE(__rseq_abi.cpu_id_start, idx);
+    RSEQ_SAFE_WRITE(__rseq_abi.cpu_id, idx);
+}
+
+// 1 if the calling thread has no index of its own
+uint32_t ALWAYS_INLINE
+rseq_fallback_no_idx_held() {
+    return rseq_fallback &&
+           RSEQ_SAFE_ACCESS(__rseq_abi.cpu_id_start) == rseq_fallback_no_idx;
+}
+
+// Runs f() as the only thread on the shared index, for a thread without
+// one of its own. Nothing in f() may take the shared index again.
+template<typename F>
+void
+rseq_fallback_run_shared(F f) {
+    pthread_mutex_lock(&rseq_fallback_shared_lock);
+    rseq_fallback_set_idx(rseq_fallback_shared_idx);
+    f();
+    rseq_fallback_set_idx(rseq_fallback_no_idx);
+    pthread_mutex_unlock(&rseq_fallback_shared_lock);
+}
+
+static void
+rseq_fallback_release(void * _idx) {
+    const uint32_t idx = (uint32_t)(uint64_t)_idx;
+    rseq_fallback_set_idx(rseq_fallback_no_idx);
+
+    pthread_mutex_lock(&rseq_fallback_lock);
+    rseq_fallback_free[rseq_fallback_nfree++] = idx;
+    pthread_mutex_unlock(&rseq_fallback_lock);
+}
+
+static void
+rseq_fallback_init_key() {
+    ERROR_ASSERT(
+        !pthread_key_create(&rseq_fallback_key, rseq_fallback_release));
+}
+
+void
+rseq_fallback_register() {
+    static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+    pthread_once(&key_once, rseq_fallback_init_key);
+
+    pthread_mutex_lock(&rseq_fallback_lock);
+    uint32_t idx = rseq_fallback_no_idx;
+    if (rseq_fallback_nfree) {
+        idx = rseq_fallback_free[--rseq_fallback_nfree];
+    }
+    else if (rseq_fallback_next < RSEQ_FALLBACK_MAX_THREADS) {
+        idx = rseq_fallback_next++;
+    }
+    pthread_mutex_unlock(&rseq_fallback_lock);
+
+    // more threads than indexes, this one goes without for good
+    if (idx == rseq_fallback_no_idx) {
+        return;
+    }
+
+    // index is released in the key destructor (non-NULL value needed)
+    ERROR_ASSERT(
+        !pthread_setspecific(rseq_fallback_key, (void *)(uint64_t)idx));
+    rseq_fallback_set_idx(idx);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Fork. The kernel keeps the forking thread's rseq registration in the
+// child (and libc's area is in its copied tls) so rseq itself keeps
+// working. What has to be fixed up is process state: the membarrier
+// registration is per process and every fallback index other than the
+// forking thread's belongs to a thread that does not exist in the child.
+static void
+rseq_fork_prepare(void * unused) {
+    (void)(unused);
+    pthread_mutex_lock(&rseq_fallback_shared_lock);
+    pthread_mutex_lock(&rseq_fallback_lock);
+}
+
+static void
+rseq_fork_parent(void * unused) {
+    (void)(unused);
+    pthread_mutex_unlock(&rseq_fallback_lock);
+    pthread_mutex_unlock(&rseq_fallback_shared_lock);
+}
+
+static void
+rseq_fork_child(void * unused) {
+    (void)(unused);
+    rseq_fence_state = FENCE_UNKNOWN;
+
+    if (rseq_fallback) {
+        // the caches of the freed indexes are left as is, whichever thread
+        // gets the index next uses them
+        const uint32_t self = __rseq_abi.cpu_id;
+        rseq_fallback_nfree = 0;
+        for (uint32_t idx = rseq_fallback_next - 1;
+             idx > rseq_fallback_shared_idx;
+             --idx) {
+            if (idx != self) {
+                rseq_fallback_free[rseq_fallback_nfree++] = idx;
+            }
+        }
+    }
+    pthread_mutex_unlock(&rseq_fallback_lock);
+    pthread_mutex_unlock(&rseq_fallback_shared_lock);
+}
+
+fork_hooks rseq_fork_hooks = { rseq_fork_prepare,
+                               rseq_fork_parent,
+                               rseq_fork_child,
+                               NULL,
+                               NULL,
+                               NULL };
+
+// before any allocator adds its hooks so rseq's child hook runs last
+static void __attribute__((constructor(101)))
+rseq_init_fork() {
+    add_fork_hooks(&rseq_fork_hooks);
+}
+
+// number of per-cpu indexes structures have to be sized for
+uint32_t
+rseq_num_idx(const uint32_t nprocs) {
+    return rseq_fallback ? RSEQ_FALLBACK_MAX_THREADS : nprocs;
+}
+
 void
 safe_rseq_syscall() {
     ERROR_ASSERT(
@@ -23,6 +414,14 @@ safe_rseq_syscall() {
 
 void
 register_thread() {
+    if (rseq_fallback) {
+        rseq_fallback_register();
+        return;
+    }
+    // libc registered before this thread ran any user code
+    if (rseq_libc_registered()) {
+        return;
+    }
     const uint32_t ret =
         syscall(NR_rseq, &__rseq_abi, sizeof(__rseq_abi), 0, RSEQ_SIGNATURE);
     // double initialization
@@ -38,16 +437,60 @@ init_thread() {
     }
 }
 
+// registers on first slow path entry for threads that were not created
+// through pthread_create (see RSEQ_AUTO_REGISTER)
+void ALWAYS_INLINE
+ensure_thread() {
+    if (BRANCH_UNLIKELY(rseq_refcount == 0)) {
+        init_thread();
+    }
+}
+
+// new threads (see rseq_init)
+static void
+rseq_register_new_thread() {
+    init_thread();
+}
+
+#if RSEQ_AUTO_REGISTER
+// after rseq_init, before ordinary static initializers
+static void __attribute__((constructor(102)))
+rseq_register_main_thread() {
+    init_thread();
+}
+#endif
+
 // current cpu
 uint32_t ALWAYS_INLINE PURE_ATTR
 get_cur_cpu() noexcept {
-    return RSEQ_SAFE_ACCESS(__rseq_abi.cpu_id);
+    return RSEQ_SAFE_ACCESS(rseq_area()->cpu_id);
 }
 
 // cpu to start sequence on
 uint32_t ALWAYS_INLINE PURE_ATTR
 get_start_cpu() noexcept {
-    return RSEQ_SAFE_ACCESS(__rseq_abi.cpu_id_start);
+    return RSEQ_SAFE_ACCESS(rseq_area()->cpu_id_start);
+}
+
+// per-cpu index to start sequence on. cpu_id_start when indexing by cpu
+// (always a valid cpu even before registration) or thread, otherwise mm_cid
+uint32_t ALWAYS_INLINE PURE_ATTR
+get_start_idx() noexcept {
+    return BRANCH_LIKELY(rseq_idx_offset == RSEQ_CPU_ID_OFFSET)
+               ? get_start_cpu()
+               : RSEQ_SAFE_ACCESS(rseq_area()->mm_cid);
+}
+
+// numa node of the current cpu, from the rseq area if the kernel fills it
+// in. Only a hint, the thread may be migrated right after.
+uint32_t
+get_cur_node() noexcept {
+    if (BRANCH_LIKELY(rseq_has_node_id)) {
+        return RSEQ_SAFE_ACCESS(rseq_area()->node_id);
+    }
+    // cpu_id is a thread index in fallback mode
+    const int32_t cpu = rseq_fallback ? sched_getcpu() : get_cur_cpu();
+    return cpu < 0 ? 0 : sysi::cpu_to_node(cpu);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -91,7 +534,7 @@ get_start_cpu_check() noexcept {
 
 void ALWAYS_INLINE
 clear_rseq() noexcept {
-    RSEQ_SAFE_WRITE(__rseq_abi.ptr, 0);
+    RSEQ_SAFE_WRITE(rseq_area()->ptr, 0);
 }
 
 
@@ -0,0 +1,75 @@
+#include <concurrency/rseq/rseq_thread_hook.h>
+#include <misc/cpp_attributes.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+
+// Only linked to pthread_create in a binary linked with
+// -Wl,--wrap=pthread_create, otherwise a weak undefined symbol (NULL) and
+// __wrap_pthread_create is never called.
+extern "C" int __real_pthread_create(pthread_t *,
+                                     const pthread_attr_t *,
+                                     void * (*)(void *),
+                                     void *) __attribute__((weak));
+
+static rseq_thread_hook_t thread_hook;
+
+uint32_t
+rseq_thread_hook_linked() {
+    return &__real_pthread_create != NULL;
+}
+
+uint32_t
+rseq_set_thread_hook(rseq_thread_hook_t hook) {
+    if (!rseq_thread_hook_linked()) {
+        return 0;
+    }
+    __atomic_store_n(&thread_hook, hook, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+struct rseq_thread_start {
+    rseq_thread_hook_t hook;
+    void * (*f)(void *);
+    void * arg;
+};
+
+static void *
+rseq_thread_trampoline(void * _start) {
+    const rseq_thread_start start = *((rseq_thread_start *)_start);
+    free(_start);
+
+    start.hook();
+    return start.f(start.arg);
+}
+
+extern "C" int
+__wrap_pthread_create(pthread_t *            tid,
+                      const pthread_attr_t * attr,
+                      void * (*f)(void *),
+                      void * arg) noexcept {
+    const rseq_thread_hook_t hook =
+        __atomic_load_n(&thread_hook, __ATOMIC_ACQUIRE);
+    if (hook == NULL) {
+        return __real_pthread_create(tid, attr, f, arg);
+    }
+
+    rseq_thread_start * start =
+        (rseq_thread_start *)malloc(sizeof(rseq_thread_start));
+    if (start == NULL) {
+        return EAGAIN;
+    }
+    start->hook = hook;
+    start->f    = f;
+    start->arg  = arg;
+
+    const int ret =
+        __real_pthread_create(tid, attr, rseq_thread_trampoline, start);
+    if (ret) {
+        free(start);
+    }
+    return ret;
+}
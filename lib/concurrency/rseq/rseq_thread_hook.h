@@ -0,0 +1,26 @@
+#ifndef _RSEQ_THREAD_HOOK_H_
+#define _RSEQ_THREAD_HOOK_H_
+
+#include <stdint.h>
+
+// Runs a hook in every new thread before its start routine, used to
+// register threads with rseq before they run any user code (see
+// RSEQ_AUTO_REGISTER in rseq_helpers.h).
+//
+// This interposes pthread_create, so it is opt-in at link time: only a
+// binary linked with -Wl,--wrap=pthread_create has its pthread_create
+// calls go through the wrapper (rseq_thread_hook.cc, CMakeLists.txt adds
+// the flag to targets that include the rseq or allocator headers). Calls
+// from other shared libraries are never wrapped. To turn it off, link
+// without the flag and build with RSEQ_AUTO_REGISTER=0 (threads then
+// register with init_thread()). Without a hook the wrapper just forwards.
+typedef void (*rseq_thread_hook_t)();
+
+// 1 if the binary was linked with the wrapper
+uint32_t rseq_thread_hook_linked();
+
+// 0 (and nothing set) if the wrapper isn't linked. Call from a
+// constructor before any thread is created.
+uint32_t rseq_set_thread_hook(rseq_thread_hook_t hook);
+
+#endif
@@ -18,7 +18,7 @@
 #define DBG_PUSH_FRAME(bytes)                                                  \
     if (tframes) {                                                             \
         tframes->push_frame(__LINE__,                                          \
-                            __rseq_abi.cpu_id_start,                           \
+                            get_start_cpu(),                                   \
                             (uint64_t)(bytes),                                 \
                             __FN__);                                           \
     }
@@ -4,19 +4,7 @@
 
 #include <stdint.h>
 
-// Number of processors (this is cores includes hyperthreads)
-#define NPROCS 8
-
-// Number of physical cores
-#define NCORES 4
-
-// Logical to physical core lookup
-#define PHYS_CORE(X) get_phys_core(X)
-uint32_t inline __attribute__((always_inline)) __attribute__((const))
-get_phys_core(const uint32_t logical_core_num) {
-	static const constexpr uint32_t core_map[NPROCS] = { 0, 1, 2, 3, 0, 1, 2, 3 };
-	return core_map[logical_core_num];
-}
+// NPROCS, NCORES and PHYS_CORE are resolved at runtime (see cpu_topology.h)
 
 // Transparent Huge Page Configuration
 enum THP { ALWAYS = 0, MADVISE = 1, NEVER = 2 };
@@ -0,0 +1,340 @@
+#ifndef _CPU_TOPOLOGY_H_
+#define _CPU_TOPOLOGY_H_
+
+#include <misc/cpp_attributes.h>
+#include <misc/error_handling.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////////////////////////
+// Cpu topology is resolved at startup from /sys rather than baked into
+// PRECOMPUTED_SYS_INFO.h so that a binary built on one machine sizes its
+// per-cpu structures correctly on another.
+//
+// NPROCS is 1 + the highest cpu id in the possible mask. Every cpu id the
+// kernel can ever report (including cpus that are hotplugged in later)
+// is < NPROCS. Ids can be sparse, ids missing from the mask are just never
+// used.
+//
+// Which of those cpus the process can actually run on (cpuset / affinity)
+// can change at any time so is never cached here, see reachable_cpus.
+
+#define NPROCS       sysi::nprocs()
+#define NCORES       sysi::ncores()
+#define NNODES       sysi::nnodes()
+#define PHYS_CORE(X) sysi::phys_core(X)
+
+namespace sysi {
+
+static constexpr uint32_t unknown_core = (~(0U));
+
+// well above any NR_CPUS we would see
+static constexpr uint32_t max_possible_cpus = 8192;
+
+typedef struct cpu_topology {
+    uint32_t nprocs;
+    uint32_t ncores;
+    // 1 + highest possible numa node (1 without numa)
+    uint32_t nnodes;
+    // cpu -> index of its physical core in core_keys
+    uint32_t * core_map;
+    uint32_t * node_map;
+    // (package << 32) | core_id of each physical core, ncores of them
+    uint64_t * core_keys;
+} cpu_topology_t;
+
+static constexpr uint32_t cpu_mask_words = max_possible_cpus / 64;
+
+// same bit layout as the kernel's cpumask so can be passed to
+// sched_getaffinity directly
+typedef struct cpu_mask {
+    uint64_t bits[cpu_mask_words];
+} cpu_mask_t;
+
+static uint32_t ALWAYS_INLINE
+cpu_mask_test(const cpu_mask_t * mask, const uint32_t cpu) {
+    return (mask->bits[cpu / 64] >> (cpu % 64)) & 0x1;
+}
+
+
+// parses kernel cpulist format ("0-3,8,10-11") into mask. returns 1 + the
+// highest cpu set or 0 if unable to read
+static uint32_t
+read_cpulist(const char * path, uint64_t * mask, uint32_t max_cpus) {
+    const uint32_t buf_len = 4096;
+    char           buf[buf_len];
+
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    if (fgets(buf, buf_len, fp) == NULL) {
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    uint32_t n   = 0;
+    char *   cur = buf;
+    while (*cur && *cur != '\n') {
+        char *   end;
+        uint32_t lo = strtoul(cur, &end, 10), hi = lo;
+        DIE_ASSERT(end != cur,
+                   "Error parsing cpulist at: %s (%s)\n",
+                   cur,
+                   path);
+        cur = end;
+        if (*cur == '-') {
+            ++cur;
+            hi = strtoul(cur, &end, 10);
+            DIE_ASSERT(end != cur,
+                       "Error parsing cpulist at: %s (%s)\n",
+                       cur,
+                       path);
+            cur = end;
+        }
+        DIE_ASSERT(hi < max_cpus && lo <= hi,
+                   "Error invalid cpu range %d-%d in %s\n",
+                   lo,
+                   hi,
+                   path);
+        for (uint32_t i = lo; mask && i <= hi; ++i) {
+            mask[i / 64] |= ((1UL) << (i % 64));
+        }
+        n = hi + 1;
+        if (*cur == ',') {
+            ++cur;
+        }
+    }
+    return n;
+}
+
+// -1 if the file is missing (i.e cpu is offline)
+static int32_t
+read_cpu_topology_int(uint32_t cpu, const char * field) {
+    char path[128];
+    char buf[32];
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, field);
+
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    int32_t ret = -1;
+    if (fgets(buf, 31, fp) != NULL) {
+        char * end;
+        ret = strtol(buf, &end, 10);
+        if (end == buf) {
+            ret = -1;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+
+
+// (package << 32) | core_id of cpu, unique per physical core. Returns 0
+// if the cpu is offline (no core_id)
+static uint32_t
+read_core_key(const uint32_t cpu, uint64_t * key) {
+    const int32_t core_id = read_cpu_topology_int(cpu, "core_id");
+    const int32_t pkg_id  = read_cpu_topology_int(cpu, "physical_package_id");
+    if (core_id < 0) {
+        return 0;
+    }
+    *key = ((uint64_t)(pkg_id < 0 ? 0 : pkg_id) << 32) | (uint32_t)core_id;
+    return 1;
+}
+
+// index of key in keys[0, n), n if not there
+static uint32_t
+find_core_key(const uint64_t * keys, const uint32_t n, const uint64_t key) {
+    uint32_t i;
+    for (i = 0; i < n && keys[i] != key; ++i) {
+    }
+    return i;
+}
+
+static void
+init_topology(cpu_topology_t * topo) {
+    uint32_t nprocs = read_cpulist("/sys/devices/system/cpu/possible",
+                                   NULL,
+                                   max_possible_cpus);
+    if (nprocs == 0) {
+        // no sysfs (some sandboxes), configured count is the best we have
+        nprocs = sysconf(_SC_NPROCESSORS_CONF);
+    }
+    DIE_ASSERT(nprocs > 0, "Error unable to find number of cpus\n");
+
+    uint32_t * core_map  = (uint32_t *)calloc(nprocs, sizeof(uint32_t));
+    uint64_t * core_keys = (uint64_t *)calloc(nprocs, sizeof(uint64_t));
+    ERROR_ASSERT(core_map != NULL && core_keys != NULL);
+
+    // core_id repeats across packages so physical cores are numbered
+    // densely by (package, core_id)
+    uint32_t ncores = 0;
+    for (uint32_t i = 0; i < nprocs; ++i) {
+        uint64_t key;
+        if (!read_core_key(i, &key)) {
+            core_map[i] = unknown_core;
+            continue;
+        }
+        const uint32_t j = find_core_key(core_keys, ncores, key);
+        if (j == ncores) {
+            core_keys[ncores++] = key;
+        }
+        core_map[i] = j;
+    }
+
+    // cpus not listed under any node (or no numa in sysfs) are on node 0
+    uint32_t * node_map = (uint32_t *)calloc(nprocs, sizeof(uint32_t));
+    ERROR_ASSERT(node_map != NULL);
+    uint32_t nnodes = read_cpulist("/sys/devices/system/node/possible",
+                                   NULL,
+                                   max_possible_cpus);
+    for (uint32_t n = 0; n < nnodes; ++n) {
+        char       path[128];
+        cpu_mask_t mask;
+        memset(&mask, 0, sizeof(mask));
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+        read_cpulist(path, mask.bits, max_possible_cpus);
+        for (uint32_t i = 0; i < nprocs; ++i) {
+            if (cpu_mask_test(&mask, i)) {
+                node_map[i] = n;
+            }
+        }
+    }
+
+    topo->core_map  = core_map;
+    topo->node_map  = node_map;
+    topo->core_keys = core_keys;
+    topo->ncores    = ncores;
+    topo->nnodes    = nnodes ? nnodes : 1;
+    topo->nprocs    = nprocs;
+}
+
+static cpu_topology_t _topo;
+static uint32_t       _topo_ready;
+
+static void
+_init_topology_once() {
+    init_topology(&_topo);
+    __atomic_store_n(&_topo_ready, 1, __ATOMIC_RELEASE);
+}
+
+// resolved once, by whichever thread gets here first (the others wait)
+static cpu_topology_t *
+topology() {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    if (BRANCH_UNLIKELY(!__atomic_load_n(&_topo_ready, __ATOMIC_ACQUIRE))) {
+        ERROR_ASSERT(!pthread_once(&once, _init_topology_once));
+    }
+    return &_topo;
+}
+
+static uint32_t
+nprocs() {
+    return topology()->nprocs;
+}
+
+static uint32_t
+ncores() {
+    return topology()->ncores;
+}
+
+static uint32_t
+nnodes() {
+    return topology()->nnodes;
+}
+
+// numa node of a possible cpu (as of startup)
+static uint32_t
+cpu_to_node(const uint32_t cpu) {
+    cpu_topology_t * topo = topology();
+    return cpu < topo->nprocs ? topo->node_map[cpu] : 0;
+}
+
+// dense index (< ncores()) of the physical core logical_core_num is on.
+// Cpus that were offline at startup are looked up again on first use
+// (hotplug), unknown_core if still offline or on a core not seen at
+// startup.
+static uint32_t
+phys_core(const uint32_t logical_core_num) {
+    cpu_topology_t * topo = topology();
+    DIE_ASSERT(logical_core_num < topo->nprocs,
+               "Error cpu %d is not a possible cpu\n",
+               logical_core_num);
+
+    uint32_t core =
+        __atomic_load_n(topo->core_map + logical_core_num, __ATOMIC_RELAXED);
+    uint64_t key;
+    if (BRANCH_UNLIKELY(core == unknown_core) &&
+        read_core_key(logical_core_num, &key)) {
+        core = find_core_key(topo->core_keys, topo->ncores, key);
+        if (core == topo->ncores) {
+            return unknown_core;
+        }
+        __atomic_store_n(topo->core_map + logical_core_num,
+                         core,
+                         __ATOMIC_RELAXED);
+    }
+    return core;
+}
+
+
+// path of the cgroup v2 cpuset.cpus.effective for this process. returns 0
+// if not in a v2 hierarchy
+static uint32_t
+cgroup_cpuset_path(char * path_out, const uint32_t path_len) {
+    char   buf[1024];
+    FILE * fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    uint32_t found = 0;
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        // v2 entry is "0::/path"
+        if (strncmp(buf, "0::", 3) == 0) {
+            buf[strcspn(buf, "\n")] = '\0';
+            found = snprintf(path_out,
+                             path_len,
+                             "/sys/fs/cgroup%s/cpuset.cpus.effective",
+                             buf + 3) < (int32_t)path_len;
+            break;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+// cpus any thread of this process can currently run on. The cgroup's
+// effective cpuset bounds every thread so is preferred, otherwise falls
+// back to the calling thread's affinity. Returns number of reachable cpus.
+static uint32_t
+reachable_cpus(cpu_mask_t * mask) {
+    char path[1024];
+    memset(mask, 0, sizeof(cpu_mask_t));
+
+    if (!(cgroup_cpuset_path(path, sizeof(path)) &&
+          read_cpulist(path, mask->bits, nprocs()))) {
+        memset(mask, 0, sizeof(cpu_mask_t));
+        ERROR_ASSERT(!sched_getaffinity(0, sizeof(mask->bits),
+                                        (cpu_set_t *)mask->bits));
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < cpu_mask_words; ++i) {
+        n += __builtin_popcountll(mask->bits[i]);
+    }
+    return n;
+}
+
+}  // namespace sysi
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef _FORK_HOOKS_H_
+#define _FORK_HOOKS_H_
+
+#include <misc/error_handling.h>
+#include <pthread.h>
+
+// pthread_atfork handlers can't be removed so objects that need to act
+// around fork (e.g allocators quiescing) add themselves to a list walked
+// by one set of handlers, and remove themselves when destroyed.
+//
+// prepare hooks run in list order, parent / child hooks in reverse. The
+// list lock is held from prepare until parent / child are done so the list
+// can't change across the fork.
+
+typedef void(fork_hook_func(void *));
+
+struct fork_hooks {
+    fork_hook_func * prepare;
+    fork_hook_func * parent;
+    fork_hook_func * child;
+    void *           arg;
+    fork_hooks *     prev;
+    fork_hooks *     next;
+};
+
+pthread_mutex_t fork_hooks_lock = PTHREAD_MUTEX_INITIALIZER;
+fork_hooks *    fork_hooks_head;
+fork_hooks *    fork_hooks_tail;
+
+static void
+fork_hooks_prepare() {
+    pthread_mutex_lock(&fork_hooks_lock);
+    for (fork_hooks * h = fork_hooks_head; h != NULL; h = h->next) {
+        if (h->prepare) {
+            h->prepare(h->arg);
+        }
+    }
+}
+
+static void
+fork_hooks_parent() {
+    for (fork_hooks * h = fork_hooks_tail; h != NULL; h = h->prev) {
+        if (h->parent) {
+            h->parent(h->arg);
+        }
+    }
+    pthread_mutex_unlock(&fork_hooks_lock);
+}
+
+static void
+fork_hooks_child() {
+    for (fork_hooks * h = fork_hooks_tail; h != NULL; h = h->prev) {
+        if (h->child) {
+            h->child(h->arg);
+        }
+    }
+    // only this thread exists in the child, the lock is still ours
+    pthread_mutex_unlock(&fork_hooks_lock);
+}
+
+static void
+fork_hooks_install() {
+    ERROR_ASSERT(!pthread_atfork(fork_hooks_prepare,
+                                 fork_hooks_parent,
+                                 fork_hooks_child));
+}
+
+void
+add_fork_hooks(fork_hooks * h) {
+    static pthread_once_t install_once = PTHREAD_ONCE_INIT;
+    pthread_once(&install_once, fork_hooks_install);
+
+    pthread_mutex_lock(&fork_hooks_lock);
+    h->prev = fork_hooks_tail;
+    h->next = NULL;
+    if (fork_hooks_tail) {
+        fork_hooks_tail->next = h;
+    }
+    else {
+        fork_hooks_head = h;
+    }
+    fork_hooks_tail = h;
+    pthread_mutex_unlock(&fork_hooks_lock);
+}
+
+void
+remove_fork_hooks(fork_hooks * h) {
+    pthread_mutex_lock(&fork_hooks_lock);
+    if (h->prev) {
+        h->prev->next = h->next;
+    }
+    else {
+        fork_hooks_head = h->next;
+    }
+    if (h->next) {
+        h->next->prev = h->prev;
+    }
+    else {
+        fork_hooks_tail = h->prev;
+    }
+    pthread_mutex_unlock(&fork_hooks_lock);
+}
+
+#endif
@@ -1,11 +1,36 @@
 #ifndef _MMAP_HELPERS_H_
 #define _MMAP_HELPERS_H_
 
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <misc/error_handling.h>
 #include <system/sys_info.h>
 
+// transparent huge page size (pmd mapping on x86_64)
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#endif
+
+// synchronous collapse into huge pages (linux 6.1), older kernels EINVAL
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+// fault in (writable) without touching contents (linux 5.14), older
+// kernels EINVAL
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// mmap at exactly addr without replacing anything mapped there (linux
+// 4.17), older kernels treat it as a hint
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
 namespace MMAP {
 
 #define mmap_alloc_hugepage(length)                                            \
@@ -35,6 +60,23 @@ namespace MMAP {
               (-1),                                                            \
               0)
 
+// start of the mapping is a multiple of alignment (a power of 2)
+#define mmap_alloc_aligned_reserve(length, alignment)                          \
+    MMAP::_mmap_aligned(length,                                                \
+                        alignment,                                             \
+                        (PROT_READ | PROT_WRITE),                              \
+                        (MAP_ANONYMOUS | MAP_PRIVATE),                         \
+                        __FILE__,                                              \
+                        __LINE__)
+
+#define mmap_alloc_aligned_noreserve(length, alignment)                        \
+    MMAP::_mmap_aligned(length,                                                \
+                        alignment,                                             \
+                        (PROT_READ | PROT_WRITE),                              \
+                        (MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE),         \
+                        __FILE__,                                              \
+                        __LINE__)
+
 #define mmap_alloc_pagein_reserve(length, npages)                              \
     MMAP::mmap_pagein(                                                         \
         (uint8_t * const)safe_mmap(NULL,                                       \
@@ -90,9 +132,45 @@ namespace MMAP {
 #define strong_hugepage(addr, length)                                          \
     MMAP::_strong_madvise(addr, length, MADV_HUGEPAGE, __FILE__, __LINE__);
 
+// only hints, failure (no THP support, nothing to collapse, no huge page
+// available) leaves the range as it was
+#define try_hugepage(addr, length)                                             \
+    MMAP::_try_madvise(addr, length, MADV_HUGEPAGE)
+
+#define try_collapse(addr, length)                                             \
+    MMAP::_try_madvise(addr, length, MADV_COLLAPSE)
+
+// contents are left as they are so memory others are using can be
+// populated too
+#define try_populate_write(addr, length)                                       \
+    MMAP::_try_madvise(addr, length, MADV_POPULATE_WRITE)
+
+// prefer node for pages of the range not faulted in yet (still falls back
+// to other nodes if node is out of memory). Only a hint as well.
+#define try_mbind_node(addr, length, node)                                     \
+    MMAP::_try_mbind_node(addr, length, node)
+
 #define madv_free(addr, length)                                                \
     MMAP::_strong_madvise(addr, length, MADV_DONTNEED, __FILE__, __LINE__);
 
+// madv_free with the advice picked for the mapping: MADV_DONTNEED for
+// private, MADV_REMOVE for shared (frees the file's pages, needs a file
+// system that can punch holes e.g tmpfs / memfd). Either way the range
+// reads back as zero.
+#define madv_release(addr, length, advice)                                     \
+    MMAP::_strong_madvise(addr, length, advice, __FILE__, __LINE__);
+
+// MAP_SHARED mapping of [0, length) of fd at exactly addr, fails if
+// anything is mapped there
+#define mmap_file_fixed(addr, length, fd)                                      \
+    MMAP::_mmap_fixed(addr,                                                    \
+                      length,                                                  \
+                      (PROT_READ | PROT_WRITE),                                \
+                      (MAP_SHARED | MAP_NORESERVE),                            \
+                      fd,                                                      \
+                      __FILE__,                                                \
+                      __LINE__)
+
 
 void *
 _safe_mmap(void *        addr,
@@ -162,6 +240,97 @@ _weak_madvise(void *        addr,
                  advise);
 }
 
+// returns 1 if the advice was taken
+uint32_t
+_try_madvise(void * addr, uint64_t length, int32_t advise) {
+    return madvise(addr, length, advise) == 0;
+}
+
+uint32_t
+_try_mbind_node(void * addr, uint64_t length, uint32_t node) {
+    uint64_t nodemask[16] = { 0 };
+    if (node >= sizeof(nodemask) * 8) {
+        return 0;
+    }
+    nodemask[node / 64] = (1UL) << (node % 64);
+    return syscall(SYS_mbind,
+                   addr,
+                   length,
+                   MPOL_PREFERRED,
+                   nodemask,
+                   sizeof(nodemask) * 8,
+                   0) == 0;
+}
+
+// reserves length + alignment of address space (not memory) and maps the
+// aligned part of it
+void *
+_mmap_aligned(uint64_t      length,
+              uint64_t      alignment,
+              int32_t       prot_flags,
+              int32_t       mmap_flags,
+              const char *  fname,
+              const int32_t ln) {
+    uint8_t * const p = (uint8_t *)_safe_mmap(
+        NULL,
+        length + alignment,
+        PROT_NONE,
+        (MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE),
+        (-1),
+        0,
+        fname,
+        ln);
+
+    uint8_t * const aligned =
+        (uint8_t *)((((uint64_t)p) + alignment - 1) & (~(alignment - 1)));
+    if (aligned != p) {
+        _safe_munmap(p, aligned - p, fname, ln);
+    }
+    if (aligned + length != p + length + alignment) {
+        _safe_munmap(aligned + length,
+                     (p + length + alignment) - (aligned + length),
+                     fname,
+                     ln);
+    }
+    return _safe_mmap(aligned,
+                      length,
+                      prot_flags,
+                      mmap_flags | MAP_FIXED,
+                      (-1),
+                      0,
+                      fname,
+                      ln);
+}
+
+void *
+_mmap_fixed(void *        addr,
+            uint64_t      length,
+            int32_t       prot_flags,
+            int32_t       mmap_flags,
+            int32_t       fd,
+            const char *  fname,
+            const int32_t ln) {
+    void * p = mmap(addr,
+                    length,
+                    prot_flags,
+                    mmap_flags | MAP_FIXED_NOREPLACE,
+                    fd,
+                    0);
+    // a kernel that doesn't know the flag may have put it elsewhere
+    if (p != MAP_FAILED && p != addr) {
+        _safe_munmap(p, length, fname, ln);
+        p = MAP_FAILED;
+    }
+    ERROR_ASSERT(p != MAP_FAILED,
+                 "%s:%d mmap(%p, %lu, fd %d) at a fixed address failed\n",
+                 fname,
+                 ln,
+                 addr,
+                 length,
+                 fd);
+    return p;
+}
+
 void *
 _mmap_hugepage(void *        addr,
                uint64_t      length,
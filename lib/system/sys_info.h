@@ -1,3 +1,6 @@
+// NPROCS / NCORES / PHYS_CORE are always resolved at runtime
+#include <system/cpu_topology.h>
+
 #ifndef RECOMPUTE_SYS_INFO_VALUES  // flag so that can recompute with make flag
 #if __has_include("PRECOMPUTED_SYS_INFO.h")  // have the values
 #include "PRECOMPUTED_SYS_INFO.h"            // will include _SYS_INFO_H_
@@ -45,55 +48,6 @@ static void read_kernel_header(uint64_t * page_offset_out,
                                uint64_t * start_kernel_map_out);
 
 
-#ifndef NPROCS
-#define NPROCS sysconf(_SC_NPROCESSORS_ONLN)
-#endif
-
-#ifndef NCORES
-#define NCORES sysi::compute_ncores()
-
-static uint32_t
-compute_ncores() {
-    uint32_t ncores;
-    read_proc_cpu(&ncores, NULL, NULL);
-    return ncores;
-}
-
-#endif
-
-#ifndef PHYS_CORE
-#define PHYS_CORE(X) sysi::compute_phys_core(X)
-
-static uint32_t
-compute_phys_core(uint32_t logical_core_num) {
-    uint32_t ret;
-    char     buf[8] = { 0 };
-    char *   end    = buf;
-
-    char core_info_file[128];
-    sprintf(core_info_file,
-            "/sys/devices/system/cpu/cpu%d/topology/core_id",
-            logical_core_num);
-    FILE * fp = fopen(core_info_file, "r");
-    ERROR_ASSERT(fp != NULL,
-                 "Error unable to open core info file:\n\"%s\"\n",
-                 core_info_file);
-
-    ERROR_ASSERT(fgets(buf, 7, fp) != NULL,
-                 "Error unable to read core info from file:\n\"%s\"\n",
-                 core_info_file);
-
-    ret = (uint32_t)strtol(buf, &end, 10);
-    DIE_ASSERT(
-        (end != buf),
-        "Error unable get integer type content from file contents:\n\"%s\"\n",
-        buf);
-    fclose(fp);
-
-    return ret;
-}
-#endif
-
 #ifndef PAGE_SIZE
 #define PAGE_SIZE sysconf(_SC_PAGESIZE)
 #endif
@@ -895,30 +849,9 @@ create_defs(const char * outfile) {
     fprintf(fp, "#include <stdint.h>\n");
     fprintf(fp, "\n");
     fprintf(fp,
-            "// Number of processors (this is cores includes hyperthreads)\n");
-    fprintf(fp, "#define NPROCS %d\n", (uint32_t)NPROCS);
-    fprintf(fp, "\n");
-    fprintf(fp, "// Number of physical cores\n");
-    fprintf(fp, "#define NCORES %d\n", NCORES);
+            "// NPROCS, NCORES and PHYS_CORE are resolved at runtime (see "
+            "cpu_topology.h)\n");
     fprintf(fp, "\n");
-
-    fprintf(fp, "// Logical to physical core lookup\n");
-    fprintf(fp, "#define PHYS_CORE(X) get_phys_core(X)\n");
-    fprintf(fp,
-            "uint32_t inline __attribute__((always_inline)) "
-            "__attribute__((const))\n");
-    fprintf(fp, "get_phys_core(const uint32_t logical_core_num) {\n");
-    fprintf(fp,
-            "\tstatic const constexpr uint32_t core_map[NPROCS] = { %d",
-            PHYS_CORE(0));
-    for (uint32_t i = 1; i < NPROCS; ++i) {
-        fprintf(fp, ", %d", PHYS_CORE(i));
-    }
-    fprintf(fp, " };\n");
-    fprintf(fp, "\treturn core_map[logical_core_num];\n");
-    fprintf(fp, "}\n\n");
-
-
     fprintf(fp, "// Transparent Huge Page Configuration\n");
 
     uint32_t _thp_cfg = TRANSPARENT_HUGE_PAGE_CFG;
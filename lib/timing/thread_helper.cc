@@ -32,11 +32,22 @@ thelper::spawn_n(uint32_t   nthreads,
     // this is relatively expensive but I guess the price you pay for generic
     // programming. Could replace cpu_set_t with a uint64_t but this is a mile
     // from the critical path so nbd imo
+
+    // only pin to cpus we can actually run on (cpuset may exclude some)
+    sysi::cpu_mask_t reachable;
+    sysi::reachable_cpus(&reachable);
+
+    uint32_t  nreachable = 0;
+    uint32_t  reachable_ids[CPU_SETSIZE];
     cpu_set_t full_cpu_set;
     CPU_ZERO(&full_cpu_set);
-    for (uint32_t i = 0; i < NPROCS; ++i) {
-        CPU_SET(i, &full_cpu_set);
+    for (uint32_t i = 0; i < NPROCS && i < CPU_SETSIZE; ++i) {
+        if (sysi::cpu_mask_test(&reachable, i)) {
+            CPU_SET(i, &full_cpu_set);
+            reachable_ids[nreachable++] = i;
+        }
     }
+    ERROR_ASSERT(nreachable != 0);
 
     cpu_set_t cset;
     CPU_ZERO(&cset);
@@ -46,12 +57,12 @@ thelper::spawn_n(uint32_t   nthreads,
         // there is probably a more efficient way of doing the cpu pinning, but
         // again its not that important to find...
         if (pp == pin_policy::FIRST_N) {
-            if (i < NPROCS) {
-                CPU_SET(i, &cset);
+            if (i < nreachable) {
+                CPU_SET(reachable_ids[i], &cset);
                 ERROR_ASSERT(!pthread_attr_setaffinity_np(&attr,
                                                           sizeof(cpu_set_t),
                                                           &cset));
-                CPU_CLR(i, &cset);
+                CPU_CLR(reachable_ids[i], &cset);
             }
             else {
                 ERROR_ASSERT(!pthread_attr_setaffinity_np(&attr,
@@ -60,10 +71,10 @@ thelper::spawn_n(uint32_t   nthreads,
             }
         }
         else if (pp == pin_policy::RR) {
-            CPU_SET(i % NPROCS, &cset);
+            CPU_SET(reachable_ids[i % nreachable], &cset);
             ERROR_ASSERT(
                 !pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cset));
-            CPU_CLR(i % NPROCS, &cset);
+            CPU_CLR(reachable_ids[i % nreachable], &cset);
         }
         else {
             ERROR_ASSERT(!pthread_attr_setaffinity_np(&attr,
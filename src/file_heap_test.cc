@@ -0,0 +1,160 @@
+#include <util/arg.h>
+#include <util/verbosity.h>
+
+uint64_t test_size = (1 << 16);
+
+#include <allocator/object_allocator.h>
+#include <system/mmap_helpers.h>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using allocator_t = alloc::object_allocator<>;
+
+// whatever a region needs in this build (e.g one span per size class)
+static constexpr uint64_t region_size = allocator_t::default_region_size;
+
+// what the heap's root points to, every object links to the next
+struct obj {
+    obj *    next;
+    uint32_t id;
+    uint32_t size;
+    uint32_t payload[];
+
+    void
+    fill() {
+        for (uint32_t i = 0; i < (size - sizeof(obj)) / sizeof(uint32_t);
+             ++i) {
+            payload[i] = id + i;
+        }
+    }
+
+    void
+    verify() const {
+        for (uint32_t i = 0; i < (size - sizeof(obj)) / sizeof(uint32_t);
+             ++i) {
+            DIE_ASSERT(payload[i] == id + i,
+                       "Error object %d corrupted at %d\n",
+                       id,
+                       i);
+        }
+    }
+};
+
+// free address space region_align aligned for the heap, the same in every
+// process forked after
+void *
+heap_addr() {
+    void * p = mmap_alloc_aligned_noreserve(region_size,
+                                            allocator_t::region_align);
+    safe_munmap(p, region_size);
+    return p;
+}
+
+// n objects on the heap's root, ids from first_id
+void
+push_objs(allocator_t * a, const uint32_t n, const uint32_t first_id) {
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint32_t size = sizeof(obj) + ((first_id + i) % 32) * 4;
+        obj * o = (obj *)a->_allocate(size);
+        DIE_ASSERT(o != NULL, "Error out of memory\n");
+        o->id   = first_id + i;
+        o->size = size;
+        o->fill();
+        o->next    = (obj *)a->m->root;
+        a->m->root = o;
+    }
+}
+
+// checks every object on the heap's root is intact and returns how many
+uint32_t
+verify_objs(allocator_t * a) {
+    uint32_t n = 0;
+    for (obj * o = (obj *)a->m->root; o != NULL; o = o->next) {
+        DIE_ASSERT(a->in_range(o), "Error object %p not on the heap\n", o);
+        o->verify();
+        ++n;
+    }
+    return n;
+}
+
+// frees every other object on the heap's root
+void
+free_half(allocator_t * a) {
+    for (obj * o = (obj *)a->m->root; o != NULL && o->next != NULL;
+         o       = o->next) {
+        obj * dead = o->next;
+        o->next    = dead->next;
+        a->_free(dead);
+    }
+}
+
+int
+main(int argc, char ** argv) {
+    PREPARE_PARSER;
+    ADD_ARG("-n", false, Int, test_size, "Set number of objects");
+    PARSE_ARGUMENTS;
+
+    const int32_t fd = memfd_create("file_heap_test", MFD_CLOEXEC);
+    ERROR_ASSERT(fd >= 0);
+    void * const addr = heap_addr();
+
+    // a process sets the heap up, leaves objects on it and exits
+    fprintf(stderr, "%-24s", "Create Test");
+    pid_t pid = fork();
+    ERROR_ASSERT(pid >= 0);
+    if (pid == 0) {
+        allocator_t a(fd, addr, region_size);
+        DIE_ASSERT(a.m->root == NULL, "Error new heap has a root\n");
+        push_objs(&a, test_size, 0);
+        DIE_ASSERT(verify_objs(&a) == test_size, "Error lost objects\n");
+        _exit(0);
+    }
+    int status;
+    ERROR_ASSERT(waitpid(pid, &status, 0) == pid);
+    DIE_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+               "Error creating process failed\n");
+    fprintf(stderr, " - Passed\n");
+
+    // the next finds them and keeps using the heap, twice over (the second
+    // attach is to a heap this process tore down)
+    fprintf(stderr, "%-24s", "Reattach Test");
+    uint32_t nobjs = test_size;
+    for (uint32_t i = 0; i < 2; ++i) {
+        allocator_t * a = new allocator_t(fd, addr, region_size);
+        DIE_ASSERT(verify_objs(a) == nobjs,
+                   "Error found %d of %d objects\n",
+                   verify_objs(a),
+                   nobjs);
+        free_half(a);
+        nobjs -= nobjs / 2;
+        push_objs(a, test_size, test_size * (i + 1));
+        nobjs += test_size;
+        DIE_ASSERT(verify_objs(a) == nobjs, "Error lost objects\n");
+        delete a;
+    }
+    fprintf(stderr, " - Passed [%d]\n", nobjs);
+
+    // a forked child has no access to the parent's heap, its first use
+    // faults rather than corrupting it
+    fprintf(stderr, "%-24s", "Fork Test");
+    allocator_t * a = new allocator_t(fd, addr, region_size);
+    pid             = fork();
+    ERROR_ASSERT(pid >= 0);
+    if (pid == 0) {
+        a->_allocate(8);
+        _exit(0);
+    }
+    ERROR_ASSERT(waitpid(pid, &status, 0) == pid);
+    DIE_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV,
+               "Error forked child used the parent's heap\n");
+    DIE_ASSERT(verify_objs(a) == nobjs, "Error lost objects\n");
+    push_objs(a, test_size, 3 * test_size);
+    DIE_ASSERT(verify_objs(a) == nobjs + test_size, "Error lost objects\n");
+    delete a;
+    fprintf(stderr, " - Passed\n");
+
+    close(fd);
+}
@@ -0,0 +1,245 @@
+#include <util/arg.h>
+#include <util/verbosity.h>
+
+uint64_t test_size = (1 << 16);
+uint32_t nthreads  = 4;
+
+#include <allocator/io_buffer_pool.h>
+#include <allocator/object_allocator.h>
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+
+using allocator_t = alloc::object_allocator<>;
+
+static constexpr uint64_t buf_size = 4096;
+static constexpr uint64_t nbufs    = 2048;
+static constexpr uint32_t nheld    = 64;
+
+using pool_t = alloc::io_buffer_pool<allocator_t, buf_size>;
+
+allocator_t * allocator;
+pool_t *      pool;
+
+// thread holding each buffer (0 if free), a buffer handed out twice is
+// caught on the way out
+uint32_t * holder;
+// buffers handed from one thread to the next, put by whoever takes them
+uint64_t * handoff;
+
+void *
+get_buf(const uint32_t tid) {
+    void * buf = pool->get();
+    if (buf == NULL) {
+        return NULL;
+    }
+    DIE_ASSERT(pool->owns(buf) && ((uint64_t)buf) % buf_size == 0,
+               "Error bad buffer %p\n",
+               buf);
+    const uint64_t i        = (((uint64_t)buf) - pool->base) / buf_size;
+    uint32_t       expected = 0;
+    DIE_ASSERT(
+        __atomic_compare_exchange_n(holder + i,
+                                    &expected,
+                                    tid,
+                                    0,
+                                    __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED),
+        "Error buffer %lu handed out to %d and %d\n",
+        i,
+        expected,
+        tid);
+    memset(buf, tid, buf_size);
+    return buf;
+}
+
+void
+put_buf(void * buf) {
+    const uint64_t i   = (((uint64_t)buf) - pool->base) / buf_size;
+    const uint32_t tid = holder[i];
+    DIE_ASSERT(((uint8_t *)buf)[0] == (uint8_t)tid &&
+                   ((uint8_t *)buf)[buf_size - 1] == (uint8_t)tid,
+               "Error buffer %lu overwritten\n",
+               i);
+    __atomic_store_n(holder + i, 0, __ATOMIC_RELAXED);
+    pool->put(buf);
+}
+
+// holds up to nheld buffers at a time, half its puts are of buffers
+// another thread got
+void *
+get_put(void * arg) {
+    const uint32_t tid     = (uint32_t)(uint64_t)arg;
+    void *         held[nheld] = { NULL };
+    for (uint64_t i = 0; i < test_size; ++i) {
+        void ** slot = held + (i % nheld);
+        if (i & 1) {
+            void * mine = *slot;
+            *slot       = (void *)__atomic_exchange_n(handoff + (i % nthreads),
+                                                (uint64_t)mine,
+                                                __ATOMIC_ACQ_REL);
+        }
+        if (*slot != NULL) {
+            put_buf(*slot);
+        }
+        *slot = get_buf(tid);
+    }
+    for (uint32_t i = 0; i < nheld; ++i) {
+        if (held[i] != NULL) {
+            put_buf(held[i]);
+        }
+    }
+    return NULL;
+}
+
+// gets every buffer there is, returns how many
+uint64_t
+get_all(void ** bufs) {
+    uint64_t n = 0;
+    while ((bufs[n] = get_buf(1)) != NULL) {
+        ++n;
+        DIE_ASSERT(n <= pool->nbufs, "Error more buffers than the pool\n");
+    }
+    return n;
+}
+
+int
+main(int argc, char ** argv) {
+    PREPARE_PARSER;
+    ADD_ARG("-n", false, Int, test_size, "Set gets per thread");
+    ADD_ARG("-t", "--threads", false, Int, nthreads, "Set number of threads");
+    PARSE_ARGUMENTS;
+
+    allocator = new allocator_t();
+    pool      = new pool_t(allocator, nbufs);
+    DIE_ASSERT(pool->nbufs >= nbufs && pool->nfree() == pool->nbufs,
+               "Error pool of %lu buffers\n",
+               pool->nbufs);
+    holder  = (uint32_t *)calloc(pool->nbufs, sizeof(uint32_t));
+    handoff = (uint64_t *)calloc(nthreads, sizeof(uint64_t));
+    ERROR_ASSERT(holder != NULL && handoff != NULL);
+    void ** bufs = (void **)calloc(pool->nbufs + 1, sizeof(void *));
+    ERROR_ASSERT(bufs != NULL);
+
+    // threads getting buffers and putting their own and each other's
+    fprintf(stderr, "%-24s", "Get Put Test");
+    pthread_t * tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    ERROR_ASSERT(tids != NULL);
+    for (uint32_t i = 0; i < nthreads; ++i) {
+        ERROR_ASSERT(!pthread_create(tids + i,
+                                     NULL,
+                                     get_put,
+                                     (void *)(uint64_t)(i + 2)));
+    }
+    for (uint32_t i = 0; i < nthreads; ++i) {
+        ERROR_ASSERT(!pthread_join(tids[i], NULL));
+    }
+    free(tids);
+    for (uint32_t i = 0; i < nthreads; ++i) {
+        if (handoff[i] != 0) {
+            put_buf((void *)handoff[i]);
+        }
+    }
+    fprintf(stderr, " - Passed\n");
+
+    // Once the stack is empty get drains the cpus' caches: all the
+    // buffers can be had, wherever they were put. Without
+    // rseq_fence_supported() the ones cached on other cpus are out of
+    // reach.
+    fprintf(stderr, "%-24s", "Drain Test");
+    uint64_t n = get_all(bufs);
+    DIE_ASSERT(n == pool->nbufs || !rseq_fence_supported(),
+               "Error got %lu of %lu buffers\n",
+               n,
+               pool->nbufs);
+    DIE_ASSERT(pool->nfree() == 0, "Error buffers left on the stack\n");
+    // fewer than a cache holds, all stay on this cpu
+    const uint64_t ncached = pool_t::cache_size;
+    for (uint64_t i = 0; i < ncached; ++i) {
+        put_buf(bufs[--n]);
+    }
+    DIE_ASSERT(pool->nfree() == 0, "Error cached buffers on the stack\n");
+    if (rseq_fence_supported()) {
+        pthread_mutex_lock(&(pool->lock));
+        pool->_drain_all();
+        pthread_mutex_unlock(&(pool->lock));
+        DIE_ASSERT(pool->nfree() == ncached,
+                   "Error drained %lu of %lu buffers\n",
+                   pool->nfree(),
+                   ncached);
+    }
+    DIE_ASSERT(get_all(bufs + n) == ncached, "Error lost cached buffers\n");
+    n += ncached;
+    while (n) {
+        put_buf(bufs[--n]);
+    }
+    fprintf(stderr, " - Passed\n");
+
+    // registered with a real ring, a second registration is refused while
+    // the first holds
+    fprintf(stderr, "%-24s", "Register Test");
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int32_t ring_fd = syscall(__NR_io_uring_setup, 4, &params);
+    int32_t       r =
+        ring_fd < 0 ? -errno : pool->register_buffers(ring_fd);
+    if (ring_fd < 0 || r == -ENOMEM) {
+        fprintf(stderr, " - Skipped (%s)\n", strerror(-r));
+    }
+    else {
+        DIE_ASSERT(r == 0, "Error registering buffers: %s\n", strerror(-r));
+        r = pool->register_buffers(ring_fd);
+        DIE_ASSERT(r == -EBUSY, "Error registered twice: %s\n", strerror(-r));
+        DIE_ASSERT(pool->unregister_buffers(ring_fd) == 0,
+                   "Error unregistering buffers\n");
+        DIE_ASSERT(pool->register_buffers(ring_fd) == 0 &&
+                       pool->unregister_buffers(ring_fd) == 0,
+                   "Error registering buffers again\n");
+        fprintf(stderr, " - Passed [%lu]\n", pool->nregistered());
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+    }
+
+    free(bufs);
+    free(holder);
+    free(handoff);
+
+    // Destroyed after a reset() the pool leaves its slabs alone: by then
+    // they are carved again for objects. Objects are allocated until they
+    // cover where the slabs were, none may be handed out again.
+    fprintf(stderr, "%-24s", "Reset Test");
+    allocator->reset();
+    const uint64_t pool_end = (uint64_t)(pool->slabs + pool->nslabs);
+    const uint64_t max_objs = 4 * pool->nslabs * sizeof(pool_t::slab_t) / 8;
+    uint64_t ** objs = (uint64_t **)calloc(2 * max_objs, sizeof(uint64_t *));
+    ERROR_ASSERT(objs != NULL);
+    uint64_t nobjs = 0;
+    do {
+        DIE_ASSERT(nobjs < max_objs, "Error objects never reached the pool\n");
+        objs[nobjs] = (uint64_t *)allocator->_allocate(8);
+        DIE_ASSERT(objs[nobjs] != NULL, "Error out of memory\n");
+        *(objs[nobjs]) = nobjs;
+    } while ((uint64_t)objs[nobjs++] < pool_end);
+
+    delete pool;
+    for (uint64_t i = nobjs; i < 2 * nobjs; ++i) {
+        objs[i] = (uint64_t *)allocator->_allocate(8);
+        DIE_ASSERT(objs[i] != NULL, "Error out of memory\n");
+        *(objs[i]) = i;
+    }
+    for (uint64_t i = 0; i < 2 * nobjs; ++i) {
+        DIE_ASSERT(*(objs[i]) == i, "Error object %lu handed out twice\n", i);
+        allocator->_free(objs[i]);
+    }
+    free(objs);
+    fprintf(stderr, " - Passed [%lu]\n", nobjs);
+
+    delete allocator;
+}
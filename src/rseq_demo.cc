@@ -24,7 +24,7 @@ rseq_add(uint64_t * arr) {
         "1:\n\t"
         RSEQ_PREP_CS_DEF(%[cpu])
 
-        "movl %%fs:__rseq_abi@tpoff+4, %k[cpu]\n\t"
+        RSEQ_LOAD_CUR_IDX(%k[cpu])
         // cpu *= 128
         "salq $7, %[cpu]\n\t"
         
@@ -39,7 +39,8 @@ rseq_add(uint64_t * arr) {
         
         : [ cpu ] "=&r" (cpu),
           [ arr_clobber ] "=m" (*arr)
-        : [ arr ] "r" (arr)
+        : [ arr ] "r" (arr),
+          RSEQ_AREA_OPERANDS()
         : "cc" );
     // clang-format on
 }
@@ -50,7 +51,6 @@ uint64_t          cycles;
 
 #define NTHREAD 32
 #define TEST_SIZE 100000UL
-#define FUN atomic_adder
 
 void *
 rseq_adder(void * targ) {
@@ -85,7 +85,7 @@ atomic_adder(void * targ) {
 
     uint64_t start = _rdtsc();
     for (uint64_t i = 0; i < TEST_SIZE; ++i) {
-        uint32_t start_cpu = get_start_cpu();
+        uint32_t start_cpu = get_start_idx();
         __atomic_fetch_add(arr + 16 * start_cpu, 1, __ATOMIC_RELAXED);
     }
     uint64_t end = _rdtsc();
@@ -95,30 +95,41 @@ atomic_adder(void * targ) {
 }
 
 
+// cycles per increment of rseq_add against an atomic add on the same
+// per-cpu counters (the rseq fast path's cost on its own)
 int
 main() {
     uint64_t * arr = (uint64_t *)calloc(128, 8);
 
     thelp::thelper th;
 
+    const struct {
+        const char * name;
+        void * (*fn)(void *);
+    } adders[] = { { "Rseq", rseq_adder }, { "Atomic", atomic_adder } };
+
     pthread_barrier_init(&b, NULL, NTHREAD);
-    th.spawn_n(NTHREAD,
-               FUN,
-               thelp::pin_policy::FIRST_N,
-               arr,
-               0);
-    th.join_all();
-
-    for(uint32_t i = 0; i < 128; ++i) {
-        total +=arr[i];
+    for (const auto & adder : adders) {
+        memset(arr, 0, 128 * 8);
+        th.spawn_n(NTHREAD,
+                   adder.fn,
+                   thelp::pin_policy::FIRST_N,
+                   arr,
+                   0);
+        th.join_all();
+
+        total = 0;
+        for (uint32_t i = 0; i < 128; ++i) {
+            total += arr[i];
+        }
+
+        double t = cycles;
+        t /= (NTHREAD * TEST_SIZE);
+        fprintf(stderr,
+                "%-10s : %lu == %lu, %.3lf cycles\n",
+                adder.name,
+                total,
+                NTHREAD * TEST_SIZE,
+                t);
     }
-
-    double t = cycles;
-    t /= (NTHREAD * TEST_SIZE);
-    fprintf(stderr,
-            "Correct    : %lu == %lu\n"
-            "Cycles     : %.3lf\n",
-            total, NTHREAD * TEST_SIZE,
-            t);
-            
 }
@@ -0,0 +1,243 @@
+// a multi process heap needs per-cpu caches indexed by cpu id
+#define RSEQ_USE_MM_CID 0
+
+#include <util/arg.h>
+#include <util/verbosity.h>
+
+uint64_t test_size = (1 << 16);
+uint32_t nworkers  = 4;
+uint32_t nkills    = 16;
+
+#include <allocator/object_allocator.h>
+#include <system/mmap_helpers.h>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+using allocator_t = alloc::object_allocator<>;
+
+static constexpr uint64_t region_size = allocator_t::default_region_size;
+static constexpr uint32_t nslots      = 1024;
+static constexpr uint32_t nkept       = 256;
+
+struct obj {
+    uint32_t id;
+    uint32_t size;
+    uint32_t payload[];
+
+    void
+    fill() {
+        for (uint32_t i = 0; i < (size - sizeof(obj)) / sizeof(uint32_t);
+             ++i) {
+            payload[i] = id + i;
+        }
+    }
+
+    void
+    verify() const {
+        for (uint32_t i = 0; i < (size - sizeof(obj)) / sizeof(uint32_t);
+             ++i) {
+            DIE_ASSERT(payload[i] == id + i,
+                       "Error object %x corrupted at %d\n",
+                       id,
+                       i);
+        }
+    }
+};
+
+// in memory every process shares: objects handed from one process to
+// another (whoever takes one frees it)
+struct shared_state {
+    obj *    slots[nslots];
+    uint32_t stop;
+};
+
+// free address space region_align aligned for the heap, the same in every
+// process forked after
+void *
+heap_addr() {
+    void * p = mmap_alloc_aligned_noreserve(region_size,
+                                            allocator_t::region_align);
+    safe_munmap(p, region_size);
+    return p;
+}
+
+obj *
+new_obj(allocator_t * a, const uint32_t id) {
+    const uint32_t size = sizeof(obj) + (id % 32) * 4;
+    obj *          o    = (obj *)a->_allocate(size);
+    DIE_ASSERT(o != NULL, "Error out of memory\n");
+    o->id   = id;
+    o->size = size;
+    o->fill();
+    return o;
+}
+
+void
+free_obj(allocator_t * a, obj * o) {
+    DIE_ASSERT(a->in_range(o), "Error object %p not on the heap\n", o);
+    o->verify();
+    a->_free(o);
+}
+
+// Allocates test_size objects, keeping some, handing the rest to the
+// other processes through the slots and freeing what it gets back in
+// exchange. Keeps going until stopped.
+void
+worker(const int32_t  fd,
+       void * const   addr,
+       const uint32_t wid,
+       shared_state * s) {
+    allocator_t a(fd, addr, region_size, 1);
+    obj *       kept[nkept] = { NULL };
+    uint32_t    seed        = wid;
+    for (uint64_t i = 0;
+         i < test_size || !__atomic_load_n(&(s->stop), __ATOMIC_ACQUIRE);
+         ++i) {
+        obj * o = new_obj(&a, (wid << 24) | (i & ((1 << 24) - 1)));
+        obj ** slot = rand_r(&seed) % 2 ? kept + (i % nkept)
+                                        : s->slots + (rand_r(&seed) % nslots);
+        o           = __atomic_exchange_n(slot, o, __ATOMIC_ACQ_REL);
+        if (o != NULL) {
+            free_obj(&a, o);
+        }
+    }
+    for (uint32_t i = 0; i < nkept; ++i) {
+        if (kept[i] != NULL) {
+            free_obj(&a, kept[i]);
+        }
+    }
+}
+
+// Drains every cpu and gives back free memory (under the maintenance
+// and filler locks most of the time) until it is killed.
+void
+drainer(const int32_t fd, void * const addr) {
+    allocator_t a(fd, addr, region_size, 1);
+    rseq_may_migrate = 1;
+    while (1) {
+        for (uint32_t cpu = 0; cpu < a.m->nprocs; ++cpu) {
+            a.drain_cpu(cpu);
+        }
+        a.reclaim();
+        a.release_free_memory();
+    }
+}
+
+pid_t
+spawn_drainer(const int32_t fd, void * const addr) {
+    const pid_t pid = fork();
+    ERROR_ASSERT(pid >= 0);
+    if (pid == 0) {
+        drainer(fd, addr);
+        _exit(0);
+    }
+    return pid;
+}
+
+int
+main(int argc, char ** argv) {
+    PREPARE_PARSER;
+    ADD_ARG("-n", false, Int, test_size, "Set objects per worker");
+    ADD_ARG("-w", "--workers", false, Int, nworkers, "Set number of workers");
+    ADD_ARG("-k", "--kills", false, Int, nkills, "Set drainers killed");
+    PARSE_ARGUMENTS;
+
+    if (!rseq_idx_is_cpu() || SLAB_SYSTEM_FALLBACK) {
+        fprintf(stderr, "%-24s - Skipped (no per-cpu rseq)\n", "Shared Test");
+        return 0;
+    }
+
+    const int32_t fd = memfd_create("shared_heap_test", MFD_CLOEXEC);
+    ERROR_ASSERT(fd >= 0);
+    void * const   addr = heap_addr();
+    shared_state * s    = (shared_state *)mmap(NULL,
+                                             sizeof(shared_state),
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_ANONYMOUS,
+                                             -1,
+                                             0);
+    ERROR_ASSERT(s != MAP_FAILED);
+    memset(s, 0, sizeof(shared_state));
+
+    // workers allocating and freeing each other's objects while drainers
+    // are killed at random points of a drain. Whatever a dead drainer held
+    // (the maintenance lock, the filler's lock, stopped cpus) has to be
+    // recovered by the others for them to finish.
+    fprintf(stderr, "%-24s", "Shared Test");
+    pid_t * workers = (pid_t *)calloc(nworkers, sizeof(pid_t));
+    ERROR_ASSERT(workers != NULL);
+    for (uint32_t i = 0; i < nworkers; ++i) {
+        workers[i] = fork();
+        ERROR_ASSERT(workers[i] >= 0);
+        if (workers[i] == 0) {
+            worker(fd, addr, i + 1, s);
+            _exit(0);
+        }
+    }
+
+    uint32_t seed = time(NULL);
+    for (uint32_t i = 0; i < nkills; ++i) {
+        const pid_t pid = spawn_drainer(fd, addr);
+        usleep(1000 + rand_r(&seed) % 20000);
+        ERROR_ASSERT(!kill(pid, SIGKILL));
+        int status;
+        ERROR_ASSERT(waitpid(pid, &status, 0) == pid);
+        DIE_ASSERT(WIFSIGNALED(status), "Error drainer exited\n");
+    }
+    __atomic_store_n(&(s->stop), 1, __ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i < nworkers; ++i) {
+        int status;
+        ERROR_ASSERT(waitpid(workers[i], &status, 0) == workers[i]);
+        DIE_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                   "Error worker %d failed\n",
+                   i);
+    }
+    free(workers);
+    fprintf(stderr, " - Passed\n");
+
+    // what is left in the slots is intact and the heap still works after
+    // a drainer is killed with nothing else running and a process dies
+    // holding the filler's lock
+    fprintf(stderr, "%-24s", "Attach Test");
+    pid_t pid = spawn_drainer(fd, addr);
+    usleep(1000 + rand_r(&seed) % 20000);
+    ERROR_ASSERT(!kill(pid, SIGKILL));
+    ERROR_ASSERT(waitpid(pid, NULL, 0) == pid);
+
+    pid = fork();
+    ERROR_ASSERT(pid >= 0);
+    if (pid == 0) {
+        allocator_t a(fd, addr, region_size, 1);
+        a.m->filler._lock();
+        _exit(0);
+    }
+    ERROR_ASSERT(waitpid(pid, NULL, 0) == pid);
+
+    allocator_t * a = new allocator_t(fd, addr, region_size, 1);
+    uint32_t      n = 0;
+    for (uint32_t i = 0; i < nslots; ++i) {
+        if (s->slots[i] != NULL) {
+            free_obj(a, s->slots[i]);
+            s->slots[i] = NULL;
+            ++n;
+        }
+    }
+    for (uint32_t i = 0; i < nslots; ++i) {
+        s->slots[i] = new_obj(a, i);
+    }
+    a->reclaim();
+    a->release_free_memory();
+    for (uint32_t i = 0; i < nslots; ++i) {
+        free_obj(a, s->slots[i]);
+    }
+    delete a;
+    fprintf(stderr, " - Passed [%d]\n", n);
+
+    munmap(s, sizeof(shared_state));
+    close(fd);
+}
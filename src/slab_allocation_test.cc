@@ -0,0 +1,141 @@
+#include <util/arg.h>
+#include <util/verbosity.h>
+
+uint32_t nnodes = (2);
+
+#include <allocator/object_allocator.h>
+#include <allocator/slab_allocation.h>
+
+// The slab allocators only do arithmetic on the region's addresses (they
+// never touch it) so the regions here are never mapped.
+
+using slab_t = alloc::object_allocator<>::slab_t;
+
+static constexpr uint64_t nslabs_asked = 61;
+
+// the node of every slab of a chunk from node is node
+template<typename slab_allocator_t>
+void
+check_chunk(slab_allocator_t * sa,
+            const uint32_t     node,
+            slab_t *           chunk,
+            const uint64_t     nslabs) {
+    DIE_ASSERT(nslabs > 0 && nslabs <= nslabs_asked,
+               "Error chunk of %lu slabs\n",
+               nslabs);
+    DIE_ASSERT(((uint64_t)chunk) % sizeof(slab_t) == 0,
+               "Error unaligned chunk %p\n",
+               chunk);
+    DIE_ASSERT(sa->addr_to_node((uint64_t)chunk) == node &&
+                   sa->addr_to_node((uint64_t)(chunk + nslabs) - 1) == node,
+               "Error chunk %p not all on node %d\n",
+               chunk,
+               node);
+}
+
+// addr_to_node agrees with for_each_node_range, chunks come from the node
+// asked for until it runs out (then the next node's), _return_chunk only
+// takes back the last chunk handed out
+template<typename slab_allocator_t>
+void
+test_slab_allocator(slab_allocator_t * sa, const uint32_t size_idx) {
+    // slabs size_idx has on each node
+    uint64_t node_slabs[SLAB_NUMA_NODES] = { 0 };
+    sa->for_each_node_range([&](uint32_t node, uint64_t lo, uint64_t hi) {
+        if (hi > lo) {
+            DIE_ASSERT(sa->addr_to_node(lo) == node &&
+                           sa->addr_to_node(hi - 1) == node,
+                       "Error range [%lx, %lx) not on node %d\n",
+                       lo,
+                       hi,
+                       node);
+        }
+        if constexpr (slab_allocator_t::partitioned) {
+            if (slab_allocator_t::addr_to_size_idx(lo) != size_idx) {
+                return;
+            }
+        }
+        node_slabs[node] = (hi - lo) / sizeof(slab_t);
+    });
+
+    for (uint32_t node = 0; node < sa->nnodes; ++node) {
+        uint64_t nslabs;
+        slab_t * a = sa->_new_chunk(node, size_idx, nslabs_asked, &nslabs);
+        DIE_ASSERT(a != NULL, "Error no chunk on node %d\n", node);
+        check_chunk(sa, node, a, nslabs);
+
+        slab_t * b = sa->_new_chunk(node, size_idx, nslabs_asked, &nslabs);
+        DIE_ASSERT(b == a + nslabs_asked, "Error chunks not contiguous\n");
+        DIE_ASSERT(!sa->_return_chunk(size_idx, a, nslabs_asked),
+                   "Error returned a chunk that isn't the last\n");
+        DIE_ASSERT(sa->_return_chunk(size_idx, b, nslabs_asked) &&
+                       sa->_return_chunk(size_idx, a, nslabs_asked),
+                   "Error unable to return chunks\n");
+        DIE_ASSERT(sa->_new_chunk(node, size_idx, nslabs_asked, &nslabs) == a,
+                   "Error returned chunk not handed out again\n");
+        DIE_ASSERT(sa->_return_chunk(size_idx, a, nslabs_asked),
+                   "Error unable to return chunk\n");
+    }
+
+    // run node 0 out, the rest of its range is cut short and then chunks
+    // come from node 1
+    uint64_t nslabs, ntaken = 0;
+    slab_t * chunk;
+    while ((chunk = sa->_new_chunk(0, size_idx, nslabs_asked, &nslabs)) !=
+               NULL &&
+           sa->addr_to_node((uint64_t)chunk) == 0) {
+        check_chunk(sa, 0, chunk, nslabs);
+        DIE_ASSERT(nslabs == nslabs_asked ||
+                       ntaken + nslabs == node_slabs[0],
+                   "Error short chunk before the end of the range\n");
+        ntaken += nslabs;
+    }
+    DIE_ASSERT(ntaken == node_slabs[0],
+               "Error took %lu of %lu slabs on node 0\n",
+               ntaken,
+               node_slabs[0]);
+    DIE_ASSERT(chunk != NULL, "Error no fall through to node 1\n");
+    check_chunk(sa, 1, chunk, nslabs);
+    // goes back to node 1's range
+    DIE_ASSERT(sa->_return_chunk(size_idx, chunk, nslabs_asked),
+               "Error unable to return fall through chunk\n");
+}
+
+int
+main(int argc, char ** argv) {
+    PREPARE_PARSER;
+    ADD_ARG("-n", "--nodes", false, Int, nnodes, "Set number of nodes");
+    PARSE_ARGUMENTS;
+
+    DIE_ASSERT(nnodes > 1 && nnodes <= SLAB_NUMA_NODES,
+               "Error need 2 - %d nodes\n",
+               SLAB_NUMA_NODES);
+
+    {
+        using slab_allocator_t =
+            new_memory::shared_memory_slab_allocator<slab_t>;
+        const uint64_t lo = sizeof(slab_t) * ((1UL) << 20);
+        fprintf(stderr, "%-24s", "Shared Nodes Test");
+        slab_allocator_t * sa =
+            new slab_allocator_t(lo, lo + nnodes * 64 * HUGE_PAGE_SIZE, nnodes);
+        test_slab_allocator(sa, 0);
+        delete sa;
+        fprintf(stderr, " - Passed\n");
+    }
+
+    {
+        using slab_allocator_t =
+            new_memory::size_class_slab_allocator<slab_t, 28>;
+        const uint64_t base = slab_allocator_t::region_align;
+        fprintf(stderr, "%-24s", "Size Class Nodes Test");
+        slab_allocator_t * sa = new slab_allocator_t(
+            base + PAGE_SIZE,
+            base + slab_allocator_t::default_region_size,
+            nnodes);
+        for (uint32_t size_idx : { 0U, num_size_classes - 1 }) {
+            test_slab_allocator(sa, size_idx);
+        }
+        delete sa;
+        fprintf(stderr, " - Passed\n");
+    }
+}
@@ -1,8 +1,13 @@
 #include <util/arg.h>
 #include <util/verbosity.h>
 
-uint64_t          test_size = (1 << 20);
-uint64_t          nthread   = (32);
+uint64_t          test_size    = (1 << 20);
+uint64_t          nthread      = (32);
+// 0 -> no background draining, otherwise drain every cpu's caches this
+// often (us) while the tests run
+uint64_t          drain_us     = (0);
+// objects of every size class to prewarm each cpu with before each test
+uint64_t          prewarm_objs = (0);
 pthread_barrier_t b;
 
 
@@ -11,15 +16,20 @@ pthread_barrier_t b;
 #include <timing/thread_helper.h>
 #include <timing/timers.h>
 
+#include <allocator/cache_maintenance.h>
 #include <allocator/object_allocator.h>
+#include <allocator/pressure_monitor.h>
 
 #include <container/block_list.h>
 
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 #include <unordered_set>
 
 using allocator_t = alloc::object_allocator<>;
 allocator_t allocator;
+alloc::cache_maintenance<allocator_t> * maintenance;
 uint64_t    success_bytes;
 uint64_t    success_calls;
 
@@ -284,37 +294,250 @@ alloc_free_half(void * targ) {
 }
 
 
+// child of a fork taken while other threads allocate. Only it exists now
+// so anything they left half done would show up here
+void
+fork_child() {
+    simple_rng     rng;
+    alloc_tester   t;
+    const uint32_t _test_size = cmath::min<uint64_t>(test_size, 1 << 16);
+    for (uint32_t i = 0; i < _test_size; ++i) {
+        uint32_t size;
+        do {
+            size = rng.simple_rand() % 144;
+        } while (!size);
+        if (!t._new(size) && (i % 2)) {
+            t._delete();
+        }
+    }
+    t.verify_all();
+
+    // fences have to be registered again in the child
+    for (uint32_t i = 0; i < allocator.m->nprocs; ++i) {
+        allocator.drain_cpu(i);
+    }
+    t.verify_all();
+    _exit(0);
+}
+
+uint32_t
+fork_and_wait() {
+    const pid_t pid = fork();
+    ERROR_ASSERT(pid >= 0);
+    if (pid == 0) {
+        fork_child();
+    }
+    int status;
+    ERROR_ASSERT(waitpid(pid, &status, 0) == pid);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void
+start_drain() {
+    if (prewarm_objs) {
+        allocator.prewarm(~(0UL), prewarm_objs);
+    }
+    if (maintenance) {
+        DIE_ASSERT(maintenance->start(), "Error remote drain unsupported\n");
+    }
+}
+
+// before reset, maintenance may be draining
+void
+stop_drain() {
+    if (maintenance) {
+        maintenance->stop();
+    }
+}
+
+// what a pressure_monitor does under pressure, done directly. Keeps one
+// object in every 8th slab of a few huge pages worth and frees the rest so
+// once drained most slabs are free but no huge page is: their pages can
+// only go back one slab at a time (filler's ndropped_bytes).
+void
+pressure_test() {
+    using slab_t          = allocator_t::slab_t;
+    const uint64_t nslabs = 4 * HUGE_PAGE_SIZE / sizeof(slab_t);
+    const uint64_t nobjs  = nslabs * slab_t::capacity;
+    void ** objs          = (void **)malloc(nobjs * sizeof(void *));
+    ERROR_ASSERT(objs != NULL);
+    for (uint64_t i = 0; i < nobjs; ++i) {
+        objs[i] = allocator._allocate(8);
+        DIE_ASSERT(objs[i] != NULL, "Error out of memory\n");
+    }
+    uint64_t nkept = 0, last_kept = 0;
+    for (uint64_t i = 0; i < nobjs; ++i) {
+        const uint64_t slab = ((uint64_t)objs[i]) / sizeof(slab_t);
+        if (slab % 8 == 0 && slab != last_kept) {
+            objs[nkept++] = objs[i];
+            last_kept     = slab;
+        }
+        else {
+            allocator._free(objs[i]);
+        }
+    }
+
+    alloc::pressure_monitor<allocator_t> pm(&allocator);
+    const uint64_t dropped = allocator.m->filler.ndropped_bytes;
+    pm.react();
+    DIE_ASSERT(pm.nreactions == 1 &&
+                   allocator.m->filler.ndropped_bytes == dropped + pm.nreleased,
+               "Error released %lu bytes but dropped %lu\n",
+               pm.nreleased,
+               allocator.m->filler.ndropped_bytes - dropped);
+    // the calling thread's caches are drained either way
+    DIE_ASSERT(pm.nreleased || !(rseq_fence_supported() || rseq_fallback),
+               "Error nothing released under pressure\n");
+
+    for (uint64_t i = 0; i < nkept; ++i) {
+        allocator._free(objs[i]);
+    }
+    free(objs);
+    fprintf(stderr, " - Passed [%lu / %lu]\n", pm.nreleased, pm.ndrained);
+}
+
+
+// resident bytes of the process
+uint64_t
+resident_bytes() {
+    FILE * fp = fopen("/proc/self/statm", "r");
+    ERROR_ASSERT(fp != NULL);
+    uint64_t size, resident;
+    ERROR_ASSERT(fscanf(fp, "%lu %lu", &size, &resident) == 2);
+    fclose(fp);
+    return resident * PAGE_SIZE;
+}
+
+// Allocates the same objects from one thread before and after reset(1):
+// they come back at the same addresses with what was written there and
+// the memory they are on stayed resident, allocating them again doesn't
+// fault in more.
+void *
+reset_kept(void * targ) {
+    (void)(targ);
+    init_thread();
+    const uint64_t nobjs = cmath::min<uint64_t>(test_size, 1 << 16);
+    uint64_t ** objs = (uint64_t **)malloc(nobjs * sizeof(uint64_t *));
+    ERROR_ASSERT(objs != NULL);
+    uint64_t nbytes = 0;
+    for (uint64_t i = 0; i < nobjs; ++i) {
+        const uint32_t size = 8 + (i % 18) * 8;
+        objs[i]             = (uint64_t *)allocator._allocate(size);
+        DIE_ASSERT(objs[i] != NULL, "Error out of memory\n");
+        *(objs[i]) = i;
+        nbytes += size;
+    }
+
+    const uint64_t rss = resident_bytes();
+    allocator.reset(1);
+    for (uint64_t i = 0; i < nobjs; ++i) {
+        const uint32_t size = 8 + (i % 18) * 8;
+        uint64_t *     obj  = (uint64_t *)allocator._allocate(size);
+        DIE_ASSERT(obj == objs[i] && *obj == i,
+                   "Error object %lu at %p (was at %p)\n",
+                   i,
+                   obj,
+                   objs[i]);
+    }
+    const uint64_t kept_rss = resident_bytes();
+    DIE_ASSERT(kept_rss <= rss + nbytes / 4,
+               "Error resident %lu -> %lu bytes for %lu bytes of objects\n",
+               rss,
+               kept_rss,
+               nbytes);
+
+    for (uint64_t i = 0; i < nobjs; ++i) {
+        allocator._free(objs[i]);
+    }
+    free(objs);
+    success_bytes = nbytes;
+    success_calls = nobjs;
+    return NULL;
+}
+
 int
 main(int argc, char ** argv) {
     PREPARE_PARSER;
     ADD_ARG("-t", "--threads", false, Int, nthread, "Set nthreads");
     ADD_ARG("-n", false, Int, test_size, "Set n calls per thread");
+    ADD_ARG("-d",
+            "--drain",
+            false,
+            Int,
+            drain_us,
+            "Drain all caches every N us while testing");
+    ADD_ARG("-w",
+            "--prewarm",
+            false,
+            Int,
+            prewarm_objs,
+            "Prewarm every cpu with N objects per size class");
     PARSE_ARGUMENTS;
 
+    if (drain_us) {
+        // idle 0 -> drain even cpus in use
+        maintenance =
+            new alloc::cache_maintenance<allocator_t>(&allocator, drain_us, 0);
+    }
+
     ERROR_ASSERT(!pthread_barrier_init(&b, NULL, nthread));
 
     thelp::thelper th;
 
     fprintf(stderr, "%-24s", "Alloc Only Test");
+    start_drain();
     th.spawn_n(nthread, alloc_only, thelp::pin_policy::FIRST_N, NULL, 0);
     th.join_all();
+    stop_drain();
     fprintf(stderr, " - Passed [%lu (%.1E) / %lu]\n", success_bytes, (double)success_bytes, success_calls);
 
     allocator.reset();
     fprintf(stderr, "%-24s", "Alloc Free Test");
+    start_drain();
     th.spawn_n(nthread, alloc_free, thelp::pin_policy::FIRST_N, NULL, 0);
     th.join_all();
+    stop_drain();
     fprintf(stderr, " - Passed [%lu / %lu]\n", success_bytes, success_calls);
 
+    fprintf(stderr, "%-24s", "Pressure Test");
+    pressure_test();
+
     allocator.reset();
     fprintf(stderr, "%-24s", "Alloc Free Alloc Test");
+    start_drain();
     th.spawn_n(nthread, alloc_free_alloc, thelp::pin_policy::FIRST_N, NULL, 0);
     th.join_all();
+    stop_drain();
     fprintf(stderr, " - Passed [%lu / %lu]\n", success_bytes, success_calls);
 
     allocator.reset();
     fprintf(stderr, "%-24s", "Alloc Free Half Test");
+    start_drain();
+    th.spawn_n(nthread, alloc_free_half, thelp::pin_policy::FIRST_N, NULL, 0);
+    th.join_all();
+    stop_drain();
+    fprintf(stderr, " - Passed [%lu / %lu]\n", success_bytes, success_calls);
+
+    allocator.reset();
+    fprintf(stderr, "%-24s", "Fork Test");
+    start_drain();
     th.spawn_n(nthread, alloc_free_half, thelp::pin_policy::FIRST_N, NULL, 0);
+    uint32_t nforks = 0;
+    for (; nforks < 16; ++nforks) {
+        DIE_ASSERT(fork_and_wait(), "Error fork child %d failed\n", nforks);
+    }
+    th.join_all();
+    stop_drain();
+    fprintf(stderr, " - Passed [%d]\n", nforks);
+
+    allocator.reset();
+    fprintf(stderr, "%-24s", "Reset Kept Test");
+    th.spawn_n(1, reset_kept, thelp::pin_policy::FIRST_N, NULL, 0);
     th.join_all();
     fprintf(stderr, " - Passed [%lu / %lu]\n", success_bytes, success_calls);
+
+    if (maintenance) {
+        fprintf(stderr, "Drained %lu\n", maintenance->ndrained);
+        delete maintenance;
+    }
 }
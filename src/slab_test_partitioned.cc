@@ -0,0 +1,4 @@
+// slab_test with every size class in its own part of the region (see
+// SIZE_CLASS_PARTITION in allocator/object_allocator.h)
+#define SIZE_CLASS_PARTITION 1
+#include "slab_test.cc"
@@ -0,0 +1,149 @@
+#include <util/arg.h>
+#include <util/verbosity.h>
+
+// objects in the heap, their size, and dependent loads to time
+uint64_t nobjs     = (1 << 24);
+uint64_t obj_size  = (64);
+uint64_t naccesses = (1 << 24);
+// 1 -> MADV_COLLAPSE the heap before timing (see
+// object_allocator::collapse_hugepages)
+uint64_t do_collapse = (0);
+
+
+#include <optimized/const_math.h>
+#include <timing/timers.h>
+
+#include <allocator/object_allocator.h>
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Pointer chases through a large heap in random order so nearly every load
+// is to a different page. Build with -DSLAB_HUGEPAGES=1 and =0 and compare:
+// dTLB misses (if perf events are available here) and time per load drop
+// once the heap is on huge pages (AnonHugePages shows how much of it is).
+
+using allocator_t = alloc::object_allocator<>;
+allocator_t allocator;
+
+
+// -1 if the pmu (or permission) isn't there
+static int32_t
+open_dtlb_misses() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type   = PERF_TYPE_HW_CACHE;
+    attr.size   = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t
+anon_huge_kb() {
+    FILE * fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char     line[256];
+    uint64_t kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, "AnonHugePages:", strlen("AnonHugePages:"))) {
+            kb = strtoul(line + strlen("AnonHugePages:"), NULL, 10);
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+
+int
+main(int argc, char ** argv) {
+    PREPARE_PARSER;
+    ADD_ARG("-n", false, Int, nobjs, "Set n objects in the heap");
+    ADD_ARG("-s", "--size", false, Int, obj_size, "Set object size");
+    ADD_ARG("-a", "--accesses", false, Int, naccesses, "Set n loads to time");
+    ADD_ARG("-c",
+            "--collapse",
+            false,
+            Int,
+            do_collapse,
+            "Collapse the heap into huge pages before timing");
+    PARSE_ARGUMENTS;
+
+    DIE_ASSERT(obj_size >= sizeof(uint64_t) && nobjs > 1,
+               "Error need at least 2 objects of at least %lu bytes\n",
+               sizeof(uint64_t));
+
+    uint64_t ** objs = (uint64_t **)calloc(nobjs, sizeof(uint64_t *));
+    ERROR_ASSERT(objs != NULL);
+    for (uint64_t i = 0; i < nobjs; ++i) {
+        objs[i] = (uint64_t *)allocator._allocate(obj_size);
+        DIE_ASSERT(objs[i] != NULL, "Error heap full after %lu objects\n", i);
+    }
+
+    // one random cycle through every object
+    srand(0);
+    for (uint64_t i = nobjs - 1; i > 0; --i) {
+        const uint64_t j   = ((((uint64_t)rand()) << 31) | rand()) % (i + 1);
+        uint64_t *     tmp = objs[i];
+        objs[i]            = objs[j];
+        objs[j]            = tmp;
+    }
+    for (uint64_t i = 0; i < nobjs; ++i) {
+        *(objs[i]) = (uint64_t)objs[(i + 1) % nobjs];
+    }
+
+    uint32_t ncollapsed = 0;
+    if (do_collapse) {
+        ncollapsed = allocator.collapse_hugepages();
+    }
+
+    const int32_t fd = open_dtlb_misses();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    const uint64_t      start = timers::get_ns();
+    volatile uint64_t * p     = objs[0];
+    for (uint64_t i = 0; i < naccesses; ++i) {
+        p = (volatile uint64_t *)(*p);
+    }
+    const uint64_t ns = timers::get_ns() - start;
+
+    uint64_t misses = 0;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = 0;
+        }
+        close(fd);
+    }
+
+    fprintf(stderr,
+            "SLAB_HUGEPAGES=%d heap=%lu MB collapsed=%u AnonHugePages=%lu MB\n",
+            SLAB_HUGEPAGES,
+            (nobjs * obj_size) >> 20,
+            ncollapsed,
+            anon_huge_kb() >> 10);
+    fprintf(stderr, "%.2lf ns / load", ((double)ns) / naccesses);
+    if (fd >= 0) {
+        fprintf(stderr,
+                ", %.3lf dTLB misses / load\n",
+                ((double)misses) / naccesses);
+    }
+    else {
+        fprintf(stderr, ", dTLB misses unavailable\n");
+    }
+    free(objs);
+}